@@ -0,0 +1,715 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fastcgi.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/*
+ * A load generator for soup.
+ *
+ * It writes a corpus of articles, static files and templates to a directory,
+ * starts soup there on a FastCGI socket and posts the initial comments. It
+ * then replays a mix of requests over a number of kept-open connections and
+ * prints the throughput and the latency percentiles of each kind of request.
+ */
+
+#define SOCKET_NAME  "soup.sock"
+#define ARTICLE_SIZE 4096
+#define STATIC_FILES 32
+#define PAGE_SIZE    20
+#define FIRST_YEAR   2010
+#define YEARS        15
+#define HEADER_MAX   1024
+#define READ_MAX     (FCGI_HEADER_LEN + 0xffff + 0xff)
+
+enum kind { STATIC, ARTICLE, LIST, POST, KINDS };
+
+static const char *kind_names[KINDS] = { "static", "article", "list", "post" };
+static const int   kind_status[KINDS] = { 200, 200, 200, 302 };
+
+static const struct {
+	const char *ext;
+	size_t      size;
+} static_types[] = {
+	{ "html",   2048 },
+	{ "css" ,   8192 },
+	{ "js"  ,  32768 },
+	// Larger than the default stream_threshold
+	{ "jpg" , 262144 },
+};
+#define STATIC_TYPES (sizeof(static_types) / sizeof(*static_types))
+
+struct conn {
+	int       fd;
+	unsigned  seed;
+	// Requests to send in the current phase and their results
+	size_t    count;
+	int       seeding;
+	uint64_t *latency;
+	unsigned char *kinds;
+	size_t    errors;
+	size_t    bytes;
+	pthread_t thread;
+	// Received data that hasn't been parsed yet
+	size_t    in_start;
+	size_t    in_end;
+	char      in[READ_MAX];
+};
+
+
+static size_t   article_count = 1000;
+static size_t   comment_count = 5000;
+static size_t   conn_count    = 8;
+static size_t   request_count = 100000;
+static int      soup_workers  = 4;
+static unsigned mix[KINDS]    = { 50, 30, 15, 5 };
+static unsigned mix_total;
+static const char *root_dir = "bench-root";
+static const char *temp_dir = "www/templates";
+static const char *encoding = "gzip";
+static pid_t soup_pid;
+
+
+/*
+ * Helpers
+ */
+static void die(const char *what)
+{
+	fprintf(stderr, "%s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Picks a number below n. Low numbers are picked more often, like the few
+ * articles that get most of the visits.
+ */
+static size_t pick(unsigned *seed, size_t n)
+{
+	double x = rand_r(seed) / ((double)RAND_MAX + 1);
+	return x * x * n;
+}
+
+
+static int cmp_latency(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Corpus
+ */
+static void make_dir(const char *path)
+{
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		die(path);
+}
+
+
+static void write_file(const char *path, const char *buf, size_t len)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		die(path);
+	if (fwrite(buf, 1, len, f) != len || fclose(f) != 0)
+		die(path);
+}
+
+
+static void fill_text(char *buf, size_t len, unsigned *seed)
+{
+	static const char *words[] = {
+		"soup", "duck", "raspberry", "pi", "kernel", "article", "comment",
+		"the", "a", "of", "with", "and", "server", "template", "cache",
+	};
+	size_t i = 0;
+	while (i < len) {
+		const char *w = words[rand_r(seed) % (sizeof(words) / sizeof(*words))];
+		size_t l = strlen(w) < len - i ? strlen(w) : len - i;
+		memcpy(buf + i, w, l);
+		i += l;
+		if (i < len)
+			buf[i++] = rand_r(seed) % 16 == 0 ? '\n' : ' ';
+	}
+}
+
+
+static void copy_templates(const char *dir)
+{
+	DIR *d = opendir(dir);
+	if (d == NULL)
+		die(dir);
+	make_dir("templates");
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		char src[PATH_MAX], dst[PATH_MAX];
+		snprintf(src, sizeof(src), "%s/%s", dir, e->d_name);
+		snprintf(dst, sizeof(dst), "templates/%s", e->d_name);
+		FILE *f = fopen(src, "r");
+		if (f == NULL)
+			die(src);
+		char buf[1 << 16];
+		size_t len = fread(buf, 1, sizeof(buf), f);
+		fclose(f);
+		write_file(dst, buf, len);
+	}
+	closedir(d);
+}
+
+
+static void make_articles()
+{
+	make_dir("blog");
+	make_dir("blog/comments");
+
+	// Start without comments so every run sees the same corpus
+	DIR *d = opendir("blog/comments");
+	if (d == NULL)
+		die("blog/comments");
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "blog/comments/%s", e->d_name);
+		if (e->d_name[0] != '.')
+			unlink(path);
+	}
+	closedir(d);
+
+	FILE *list = fopen("blog.list", "w");
+	if (list == NULL)
+		die("blog.list");
+	unsigned seed = 1;
+	char buf[ARTICLE_SIZE];
+	for (size_t i = 0; i < article_count; i++) {
+		char path[64];
+		snprintf(path, sizeof(path), "blog/a%lu.md", i);
+		int len = snprintf(buf, sizeof(buf), "Article %lu\n==========\n\n", i);
+		fill_text(buf + len, sizeof(buf) - len, &seed);
+		write_file(path, buf, sizeof(buf));
+		fprintf(list, "\"Article %lu\" \"%04lu-%02lu-%02lu %02lu:%02lu\" \"%s\" \"a%lu\"\n",
+		        i, FIRST_YEAR + i * YEARS / article_count, i % 12 + 1, i % 28 + 1,
+		        i % 24, i % 60, path, i);
+	}
+	if (fclose(list) != 0)
+		die("blog.list");
+}
+
+
+static void make_static_files()
+{
+	make_dir("static");
+	unsigned seed = 2;
+	char *buf = malloc(static_types[STATIC_TYPES - 1].size);
+	for (size_t i = 0; i < STATIC_FILES; i++) {
+		char path[64];
+		size_t size = static_types[i % STATIC_TYPES].size;
+		snprintf(path, sizeof(path), "static/f%lu.%s", i, static_types[i % STATIC_TYPES].ext);
+		fill_text(buf, size, &seed);
+		write_file(path, buf, size);
+	}
+	free(buf);
+}
+
+
+static void make_corpus(const char *templates)
+{
+	copy_templates(templates);
+	make_articles();
+	make_static_files();
+	char conf[64];
+	int len = snprintf(conf, sizeof(conf), "workers %d\n", soup_workers);
+	write_file("soup.conf", conf, len);
+}
+
+
+/*
+ * Server
+ */
+static void stop_soup()
+{
+	if (soup_pid > 0) {
+		kill(soup_pid, SIGTERM);
+		waitpid(soup_pid, NULL, 0);
+		soup_pid = 0;
+	}
+	unlink(SOCKET_NAME);
+}
+
+
+/*
+ * Starts soup the way spawn-fcgi would: with a listening socket as its
+ * standard input.
+ */
+static void start_soup(const char *soup)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = SOCKET_NAME };
+	unlink(SOCKET_NAME);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0)
+		die("Failed to create " SOCKET_NAME);
+
+	soup_pid = fork();
+	if (soup_pid < 0)
+		die("Failed to fork");
+	if (soup_pid == 0) {
+		dup2(fd, 0);
+		close(fd);
+		execl(soup, soup, (char *)NULL);
+		perror(soup);
+		_exit(127);
+	}
+	close(fd);
+	atexit(stop_soup);
+}
+
+
+static int conn_open(struct conn *c)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = SOCKET_NAME };
+	c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (c->fd < 0)
+		return -1;
+	if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+	c->in_start = c->in_end = 0;
+	return 0;
+}
+
+
+/*
+ * FastCGI client
+ */
+static size_t put_header(char *p, int type, size_t len)
+{
+	FCGI_Header *h = (FCGI_Header *)p;
+	h->version         = FCGI_VERSION_1;
+	h->type            = type;
+	h->requestIdB1     = 0;
+	h->requestIdB0     = 1;
+	h->contentLengthB1 = len >> 8;
+	h->contentLengthB0 = len;
+	h->paddingLength   = 0;
+	h->reserved        = 0;
+	return FCGI_HEADER_LEN;
+}
+
+
+static size_t put_length(char *p, size_t len)
+{
+	if (len < 0x80) {
+		p[0] = len;
+		return 1;
+	}
+	p[0] = 0x80 | len >> 24;
+	p[1] = len >> 16;
+	p[2] = len >> 8;
+	p[3] = len;
+	return 4;
+}
+
+
+static size_t put_param(char *p, const char *name, const char *value)
+{
+	size_t nl = strlen(name), vl = strlen(value), n = 0;
+	n += put_length(p + n, nl);
+	n += put_length(p + n, vl);
+	memcpy(p + n, name, nl);
+	memcpy(p + n + nl, value, vl);
+	return n + nl + vl;
+}
+
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/*
+ * Reads the next record. The content stays valid until the next call.
+ */
+static int read_record(struct conn *c, int *type, const char **content, size_t *len)
+{
+	for (;;) {
+		size_t avail = c->in_end - c->in_start;
+		if (avail >= FCGI_HEADER_LEN) {
+			FCGI_Header *h = (FCGI_Header *)(c->in + c->in_start);
+			size_t clen  = h->contentLengthB1 << 8 | h->contentLengthB0;
+			size_t total = FCGI_HEADER_LEN + clen + h->paddingLength;
+			if (avail >= total) {
+				*type    = h->type;
+				*content = c->in + c->in_start + FCGI_HEADER_LEN;
+				*len     = clen;
+				c->in_start += total;
+				return 0;
+			}
+		}
+		memmove(c->in, c->in + c->in_start, avail);
+		c->in_start = 0;
+		c->in_end   = avail;
+		ssize_t n = read(c->fd, c->in + c->in_end, sizeof(c->in) - c->in_end);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		c->in_end += n;
+	}
+}
+
+
+/*
+ * Sends a request and waits for the end of the response. Returns the status
+ * of the response or -1 if the connection broke.
+ */
+static int request(struct conn *c, const char *method, const char *path, const char *query,
+                   const char *body)
+{
+	char buf[4096], clen[24];
+	size_t n = 0, blen = strlen(body);
+	snprintf(clen, sizeof(clen), "%lu", blen);
+
+	n += put_header(buf + n, FCGI_BEGIN_REQUEST, sizeof(FCGI_BeginRequestBody));
+	FCGI_BeginRequestBody *b = (FCGI_BeginRequestBody *)(buf + n);
+	memset(b, 0, sizeof(*b));
+	b->roleB0 = FCGI_RESPONDER;
+	b->flags  = FCGI_KEEP_CONN;
+	n += sizeof(*b);
+
+	size_t start = n;
+	n += FCGI_HEADER_LEN;
+	n += put_param(buf + n, "REQUEST_METHOD", method);
+	n += put_param(buf + n, "PATH_INFO", path);
+	n += put_param(buf + n, "QUERY_STRING", query);
+	n += put_param(buf + n, "HTTP_HOST", "bench");
+	n += put_param(buf + n, "HTTP_ACCEPT_ENCODING", encoding);
+	n += put_param(buf + n, "SERVER_PROTOCOL", "HTTP/1.1");
+	if (blen > 0) {
+		n += put_param(buf + n, "CONTENT_TYPE", "application/x-www-form-urlencoded");
+		n += put_param(buf + n, "CONTENT_LENGTH", clen);
+	}
+	put_header(buf + start, FCGI_PARAMS, n - start - FCGI_HEADER_LEN);
+	n += put_header(buf + n, FCGI_PARAMS, 0);
+	if (blen > 0) {
+		n += put_header(buf + n, FCGI_STDIN, blen);
+		memcpy(buf + n, body, blen);
+		n += blen;
+	}
+	n += put_header(buf + n, FCGI_STDIN, 0);
+	if (write_all(c->fd, buf, n) < 0)
+		return -1;
+
+	// Keep the start of the output to find the status
+	char   head[HEADER_MAX];
+	size_t head_len = 0;
+	for (;;) {
+		int type;
+		const char *content;
+		size_t len;
+		if (read_record(c, &type, &content, &len) < 0)
+			return -1;
+		if (type == FCGI_END_REQUEST)
+			break;
+		if (type != FCGI_STDOUT)
+			continue;
+		size_t l = len < sizeof(head) - 1 - head_len ? len : sizeof(head) - 1 - head_len;
+		memcpy(head + head_len, content, l);
+		head_len += l;
+		c->bytes += len;
+	}
+	head[head_len] = 0;
+
+	// CGI responses without a Status header are 200
+	const char *s = strncmp(head, "Status: ", 8) == 0 ? head : strstr(head, "\nStatus: ");
+	if (s == NULL)
+		return 200;
+	return atoi(s + (*s == '\n' ? 9 : 8));
+}
+
+
+static int send_kind(struct conn *c, enum kind kind)
+{
+	char path[64], query[32] = "", body[128] = "";
+	size_t article = pick(&c->seed, article_count);
+	switch (kind) {
+	case STATIC: {
+		size_t i = rand_r(&c->seed) % STATIC_FILES;
+		snprintf(path, sizeof(path), "/static/f%lu.%s", i, static_types[i % STATIC_TYPES].ext);
+		break;
+	}
+	case ARTICLE:
+		snprintf(path, sizeof(path), "/blog/a%lu", article);
+		break;
+	case LIST:
+		// Either a page of the full list or all articles of a year
+		if (rand_r(&c->seed) % 2) {
+			snprintf(path, sizeof(path), "/blog");
+			snprintf(query, sizeof(query), "page=%lu",
+			         pick(&c->seed, (article_count + PAGE_SIZE - 1) / PAGE_SIZE) + 1);
+		} else {
+			snprintf(path, sizeof(path), "/blog/%u", FIRST_YEAR + rand_r(&c->seed) % YEARS);
+		}
+		break;
+	default:
+		snprintf(path, sizeof(path), "/blog/a%lu", article);
+		snprintf(body, sizeof(body), "author=bench&body=Comment+%u+from+the+load+generator",
+		         rand_r(&c->seed));
+		break;
+	}
+	return request(c, kind == POST ? "POST" : "GET", path, query, body);
+}
+
+
+/*
+ * Load
+ */
+static enum kind pick_kind(unsigned *seed)
+{
+	unsigned x = rand_r(seed) % mix_total;
+	enum kind k = 0;
+	while (x >= mix[k])
+		x -= mix[k++];
+	return k;
+}
+
+
+static void *run_conn(void *arg)
+{
+	struct conn *c = arg;
+	for (size_t i = 0; i < c->count; i++) {
+		enum kind kind = c->seeding ? POST : pick_kind(&c->seed);
+		double start = now();
+		int status = send_kind(c, kind);
+		c->latency[i] = (now() - start) * 1e9;
+		c->kinds[i]   = kind;
+		if (status == kind_status[kind])
+			continue;
+		c->errors++;
+		// The server closed the connection, e.g. because a worker crashed
+		if (status < 0) {
+			close(c->fd);
+			if (conn_open(c) < 0) {
+				c->count = i + 1;
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Sends n requests spread over all connections and returns how long it took.
+ */
+static double run_phase(struct conn *conns, size_t n, int seeding)
+{
+	for (size_t i = 0; i < conn_count; i++) {
+		struct conn *c = &conns[i];
+		c->count   = n / conn_count + (i < n % conn_count);
+		c->seeding = seeding;
+		c->errors  = 0;
+		c->bytes   = 0;
+		c->latency = realloc(c->latency, (c->count + 1) * sizeof(*c->latency));
+		c->kinds   = realloc(c->kinds  , (c->count + 1) * sizeof(*c->kinds));
+		if (c->latency == NULL || c->kinds == NULL)
+			die("Failed to allocate latencies");
+	}
+	double start = now();
+	for (size_t i = 0; i < conn_count; i++) {
+		if (pthread_create(&conns[i].thread, NULL, run_conn, &conns[i]) != 0)
+			die("Failed to create thread");
+	}
+	for (size_t i = 0; i < conn_count; i++)
+		pthread_join(conns[i].thread, NULL);
+	return now() - start;
+}
+
+
+static void print_row(const char *name, uint64_t *v, size_t n)
+{
+	if (n == 0)
+		return;
+	qsort(v, n, sizeof(*v), cmp_latency);
+	printf("%-8s %9lu %9.1f %9.1f %9.1f %9.1f\n", name, n,
+	       v[n / 2] / 1e3, v[n * 99 / 100] / 1e3, v[n * 999 / 1000] / 1e3, v[n - 1] / 1e3);
+}
+
+
+static void report(struct conn *conns, double secs)
+{
+	size_t total = 0, errors = 0, bytes = 0;
+	for (size_t i = 0; i < conn_count; i++) {
+		total  += conns[i].count;
+		errors += conns[i].errors;
+		bytes  += conns[i].bytes;
+	}
+	printf("%lu requests in %.2f s: %.0f req/s, %.1f MiB/s, %lu errors\n\n", total, secs,
+	       total / secs, bytes / secs / (1 << 20), errors);
+	printf("%-8s %9s %9s %9s %9s %9s\n", "kind", "count", "p50 us", "p99 us", "p999 us", "max us");
+
+	uint64_t *v = malloc((total + 1) * sizeof(*v));
+	if (v == NULL)
+		die("Failed to allocate latencies");
+	for (int k = 0; k <= KINDS; k++) {
+		size_t n = 0;
+		for (size_t i = 0; i < conn_count; i++) {
+			for (size_t j = 0; j < conns[i].count; j++) {
+				if (k == KINDS || conns[i].kinds[j] == k)
+					v[n++] = conns[i].latency[j];
+			}
+		}
+		print_row(k == KINDS ? "all" : kind_names[k], v, n);
+	}
+	free(v);
+}
+
+
+/*
+ * Main
+ */
+static void usage(const char *name)
+{
+	fprintf(stderr,
+	        "Usage: %s [options] <soup>\n"
+	        "  -d <dir>    directory to write the corpus to (default: %s)\n"
+	        "  -T <dir>    templates to copy (default: %s)\n"
+	        "  -a <n>      number of articles (default: %lu)\n"
+	        "  -m <n>      number of comments posted before the run (default: %lu)\n"
+	        "  -n <n>      number of requests (default: %lu)\n"
+	        "  -c <n>      number of connections (default: %lu)\n"
+	        "  -w <n>      number of soup workers (default: %d)\n"
+	        "  -e <enc>    Accept-Encoding of the requests (default: %s)\n"
+	        "  -x <mix>    weights of the requests (default: static=%u,article=%u,list=%u,post=%u)\n",
+	        name, root_dir, temp_dir, article_count, comment_count, request_count, conn_count,
+	        soup_workers, encoding, mix[STATIC], mix[ARTICLE], mix[LIST], mix[POST]);
+	exit(2);
+}
+
+
+static int parse_mix(char *arg)
+{
+	unsigned m[KINDS] = { 0 };
+	for (char *tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		char *eq = strchr(tok, '=');
+		if (eq == NULL)
+			return -1;
+		*eq = 0;
+		int k = 0;
+		while (k < KINDS && strcmp(tok, kind_names[k]) != 0)
+			k++;
+		if (k == KINDS)
+			return -1;
+		m[k] = strtoul(eq + 1, NULL, 10);
+	}
+	memcpy(mix, m, sizeof(mix));
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "d:T:a:m:n:c:w:e:x:")) != -1) {
+		switch (opt) {
+		case 'd': root_dir      = optarg; break;
+		case 'T': temp_dir      = optarg; break;
+		case 'a': article_count = strtoul(optarg, NULL, 0); break;
+		case 'm': comment_count = strtoul(optarg, NULL, 0); break;
+		case 'n': request_count = strtoul(optarg, NULL, 0); break;
+		case 'c': conn_count    = strtoul(optarg, NULL, 0); break;
+		case 'w': soup_workers  = atoi(optarg); break;
+		case 'e': encoding      = optarg; break;
+		case 'x':
+			if (parse_mix(optarg) < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	for (int k = 0; k < KINDS; k++)
+		mix_total += mix[k];
+	if (optind != argc - 1 || article_count == 0 || conn_count == 0 || soup_workers < 1 ||
+	    mix_total == 0)
+		usage(argv[0]);
+
+	// The corpus and the socket are relative to the root
+	char soup[PATH_MAX], templates[PATH_MAX];
+	if (realpath(argv[optind], soup) == NULL)
+		die(argv[optind]);
+	if (realpath(temp_dir, templates) == NULL)
+		die(temp_dir);
+	make_dir(root_dir);
+	if (chdir(root_dir) < 0)
+		die(root_dir);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Writing %lu articles to %s\n", article_count, root_dir);
+	make_corpus(templates);
+	start_soup(soup);
+
+	struct conn *conns = calloc(conn_count, sizeof(*conns));
+	if (conns == NULL)
+		die("Failed to allocate connections");
+	for (size_t i = 0; i < conn_count; i++) {
+		conns[i].seed = i + 1;
+		if (conn_open(&conns[i]) < 0)
+			die("Failed to connect to soup");
+	}
+
+	if (comment_count > 0) {
+		double secs = run_phase(conns, comment_count, 1);
+		size_t errors = 0;
+		for (size_t i = 0; i < conn_count; i++)
+			errors += conns[i].errors;
+		printf("Posted %lu comments in %.2f s, %lu errors\n", comment_count, secs, errors);
+	}
+
+	printf("Sending %lu requests over %lu connections to %d workers\n\n", request_count,
+	       conn_count, soup_workers);
+	report(conns, run_phase(conns, request_count, 0));
+
+	for (size_t i = 0; i < conn_count; i++) {
+		close(conns[i].fd);
+		free(conns[i].latency);
+		free(conns[i].kinds);
+	}
+	free(conns);
+	return 0;
+}
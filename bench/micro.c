@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include "../src/article.c"
+#include "../include/query.h"
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+
+
+/*
+ * Micro-benchmarks of the parsing code.
+ *
+ * article.c is included rather than linked so its static helpers can be called
+ * directly. Allocations are counted by wrapping malloc, calloc, realloc and
+ * temp_alloc with the linker's --wrap option, which misses allocations made
+ * inside libc. The arena is reset after every operation, so "temp B/op" is
+ * what one operation takes from a worker's arena.
+ */
+
+#define ARENA_SIZE (1 << 27)
+
+static size_t list_lines = 100000;
+static double min_time   = 0.5;
+
+static const size_t comment_counts[] = { 10, 100, 1000, 10000 };
+#define COMMENT_FILES (sizeof(comment_counts) / sizeof(*comment_counts))
+
+static volatile uintptr_t sink;
+
+
+/*
+ * Allocation counters
+ */
+static _Thread_local size_t heap_allocs, heap_bytes, temp_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_temp_alloc(size_t size);
+
+
+void *__wrap_malloc(size_t size)
+{
+	heap_allocs++;
+	heap_bytes += size;
+	return __real_malloc(size);
+}
+
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	heap_allocs++;
+	heap_bytes += n * size;
+	return __real_calloc(n, size);
+}
+
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	heap_allocs++;
+	heap_bytes += size;
+	return __real_realloc(ptr, size);
+}
+
+
+void *__wrap_temp_alloc(size_t size)
+{
+	temp_bytes += size;
+	return __real_temp_alloc(size);
+}
+
+
+/*
+ * Runner
+ */
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Runs fn until it has run for at least min_time. items is the number of
+ * fields, lines or comments one call handles.
+ */
+static void measure(const char *name, size_t items, void (*fn)(void *), void *arg)
+{
+	size_t n = 1;
+	for (;;) {
+		heap_allocs = heap_bytes = temp_bytes = 0;
+		double start = now();
+		for (size_t i = 0; i < n; i++) {
+			fn(arg);
+			temp_alloc_reset();
+		}
+		double t = now() - start;
+		if (t >= min_time) {
+			printf("%-32s %12.0f %9.1f %10.1f %11.0f %11.0f\n", name, t * 1e9 / n,
+			       t * 1e9 / n / items, (double)heap_allocs / n, (double)heap_bytes / n,
+			       (double)temp_bytes / n);
+			return;
+		}
+		// Aim a bit past min_time, but don't trust very short runs too much
+		size_t next = t > 0 ? n * min_time * 1.2 / t : n * 100;
+		n = next > n * 100 ? n * 100 : next > n ? next : n + 1;
+	}
+}
+
+
+/*
+ * Benchmarks
+ */
+static void bench_copy_query_field(void *arg)
+{
+	const char *ptr = arg;
+	sink = (uintptr_t)copy_query_field(&ptr, '&');
+}
+
+
+static void bench_parse_query(void *arg)
+{
+	sink = (uintptr_t)parse_query(arg);
+}
+
+
+static void bench_parse_date(void *arg)
+{
+	sink = parse_date(arg).num;
+}
+
+
+static void bench_copy_art_field(void *arg)
+{
+	// copy_art_field terminates the fields in place
+	char buf[256];
+	strcpy(buf, arg);
+	char *ptr = buf;
+	for (int i = 0; i < 4; i++)
+		free(copy_art_field(&ptr));
+}
+
+
+static void bench_art_load(void *arg)
+{
+	art_root root = art_load(arg);
+	if (root == NULL) {
+		perror("Failed to load the article list");
+		exit(1);
+	}
+	art_free(root);
+}
+
+
+struct comments_arg {
+	art_root root;
+	string   uri;
+	int      cold;
+};
+
+static void bench_art_get_comments(void *arg)
+{
+	struct comments_arg *c = arg;
+	if (c->cold) {
+		article a = art_find(c->root, c->uri);
+		pthread_mutex_lock(&a->lock);
+		uncache_comments(c->root, a);
+		pthread_mutex_unlock(&a->lock);
+	}
+	sink = (uintptr_t)art_get_comments(c->root, c->uri);
+}
+
+
+/*
+ * Corpus
+ */
+static char dir[] = "/tmp/soup-micro-XXXXXX";
+
+
+static void die(const char *what)
+{
+	fprintf(stderr, "%s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+
+static void write_list(const char *name, size_t lines, const char *prefix)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s.list", dir, name);
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		die(path);
+	for (size_t i = 0; i < lines; i++) {
+		fprintf(f, "\"Article %lu\" \"%04lu-%02lu-%02lu %02lu:%02lu\" \"blog/a%lu.md\" \"%s%lu\"\n",
+		        i, 2010 + i % 15, i % 12 + 1, i % 28 + 1, i % 24, i % 60, i, prefix,
+		        prefix[0] != 0 ? comment_counts[i] : i);
+	}
+	if (fclose(f) != 0)
+		die(path);
+}
+
+
+/*
+ * Writes a comment file for each entry of comment_counts. Every fourth comment
+ * is a reply, so the tree isn't flat.
+ */
+static art_root write_comments()
+{
+	char path[PATH_MAX];
+	write_list("c", COMMENT_FILES, "c");
+	snprintf(path, sizeof(path), "%s/c", dir);
+	if (mkdir(path, 0755) < 0)
+		die(path);
+	snprintf(path, sizeof(path), "%s/c/comments", dir);
+	if (mkdir(path, 0755) < 0)
+		die(path);
+
+	snprintf(path, sizeof(path), "%s/c", dir);
+	art_root root = art_load(string_create(path));
+	if (root == NULL)
+		die("Failed to load the comment list");
+	unsigned seed = 1;
+	for (size_t i = 0; i < COMMENT_FILES; i++) {
+		size_t n = comment_counts[i];
+		string *recs = temp_alloc(n * sizeof(*recs));
+		for (size_t j = 0; j < n; j++) {
+			struct comment c = {
+				.author = temp_string_create("Bench Mark"),
+				.body   = temp_string_create("A comment with <some> markup.\n\n\n"
+				                             "And a second paragraph after too many newlines."),
+				.date   = { .year = 2018, .month = 10, .day = 20, .hour = 21 },
+			};
+			size_t reply_to = j > 0 && j % 4 == 0 ? (size_t)rand_r(&seed) % j : (size_t)-1;
+			recs[j] = encode_comment(j, &c, reply_to);
+		}
+		snprintf(path, sizeof(path), "c%lu", n);
+		if (append_comments(art_comment_path(root, temp_string_create(path)), recs, n) < 0)
+			die("Failed to write comments");
+		temp_alloc_reset();
+	}
+	return root;
+}
+
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+
+/*
+ * Main
+ */
+int main(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "l:t:")) != -1) {
+		switch (opt) {
+		case 'l': list_lines = strtoul(optarg, NULL, 0); break;
+		case 't': min_time   = strtod(optarg, NULL); break;
+		default:
+			fprintf(stderr, "Usage: %s [-l <blog.list lines>] [-t <seconds per benchmark>]\n",
+			        argv[0]);
+			return 2;
+		}
+	}
+
+	temp_alloc_push(ARENA_SIZE);
+	if (mkdtemp(dir) == NULL)
+		die("Failed to create a temporary directory");
+	write_list("blog", list_lines, "");
+	art_root comments = write_comments();
+
+	printf("%-32s %12s %9s %10s %11s %11s\n", "benchmark", "ns/op", "ns/item", "allocs/op",
+	       "heap B/op", "temp B/op");
+
+	// Queries as they are sent to get_blog_page and handle_post
+	char *form = malloc(4096);
+	strcpy(form, "author=Some+One&body=");
+	for (int i = 0; i < 40; i++)
+		strcat(form, "A+line+with+%3Cmarkup%3E+%26+escapes%0A");
+	strcat(form, "&reply-to=3");
+	measure("copy_query_field", 1, bench_copy_query_field, "Some+One%21&body=x");
+	measure("parse_query (page)", 2, bench_parse_query, "page=3&limit=20");
+	measure("parse_query (comment form)", 3, bench_parse_query, form);
+	free(form);
+
+	measure("parse_date", 1, bench_parse_date, string_create("2018-10-20 21:00"));
+	measure("copy_art_field", 4, bench_copy_art_field,
+	        "\"Hello world!\" \"2018-10-10\" \"blog/hello.md\" \"hello\"\n");
+
+	char path[PATH_MAX], name[64];
+	snprintf(path, sizeof(path), "%s/blog", dir);
+	snprintf(name, sizeof(name), "art_load (%lu lines)", list_lines);
+	measure(name, list_lines, bench_art_load, string_create(path));
+
+	for (int cold = 0; cold < 2; cold++) {
+		for (size_t i = 0; i < COMMENT_FILES; i++) {
+			snprintf(path, sizeof(path), "c%lu", comment_counts[i]);
+			struct comments_arg arg = { comments, string_create(path), cold };
+			snprintf(name, sizeof(name), "art_get_comments (%lu, %s)", comment_counts[i],
+			         cold ? "cold" : "cached");
+			measure(name, comment_counts[i], bench_art_get_comments, &arg);
+			free(arg.uri);
+		}
+	}
+
+	art_free(comments);
+	nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	temp_alloc_pop();
+	return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Access log with one JSON object per request.
+ *
+ * Workers copy finished requests into a ring buffer of their own and never
+ * touch the file. A background thread drains the rings in large writes and
+ * rotates the file once it grows past a given size. If a ring is full the
+ * request is dropped from the log, and the number of dropped requests is
+ * logged instead.
+ *
+ * Several processes may append to the same file. Whichever one finds it too
+ * large rotates it, and the others reopen it once they notice.
+ */
+
+#define ACCESSLOG_RING_SIZE 1024
+// Longer URIs are cut off
+#define ACCESSLOG_URI_MAX   216
+
+
+/*
+ * Opens the log at path and starts the thread that writes to it. n threads
+ * get a ring. When the file reaches max_size bytes it is renamed to path.1,
+ * which is renamed to path.2 and so on up to path.<files>. A max_size of 0
+ * disables rotation.
+ */
+int accesslog_open(const char *path, size_t max_size, int files, int n);
+
+/*
+ * Makes the calling thread log into ring id.
+ */
+void accesslog_thread(int id);
+
+/*
+ * Logs a finished request. uri and query may be NULL. Threads without a ring
+ * don't log anything.
+ */
+void accesslog_request(const char *method, const char *uri, const char *query, int status,
+                       size_t bytes, uint64_t ns, int cached);
+
+/*
+ * Writes what is left in the rings and closes the log.
+ */
+void accesslog_close();
+
+#endif
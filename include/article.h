@@ -2,7 +2,9 @@
 #define ART_H
 
 
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 #include <stdint.h>
 #include "../lib/template/include/cinja.h"
 
@@ -31,6 +33,14 @@ typedef struct date {
 typedef struct art_root {
 	cinja_list articles;
 	string dir;
+	struct article **index;
+	size_t index_mask;
+	struct article **by_date;
+	struct article *lru_head;
+	struct article *lru_tail;
+	size_t comment_cache_size;
+	size_t comment_cache_max;
+	pthread_mutex_t lru_lock;
 } *art_root;
 
 typedef struct comment {
@@ -48,36 +58,69 @@ typedef struct article {
 	string     file;
 	string     title;
 	date_t     date;
+	size_t     position;
 	struct article *next;
 	struct article *prev;
+	pthread_mutex_t lock;
+	string     comments;
+	int        comment_count;
+	int        comments_pending;
+	int        comments_stale;
+	time_t     comments_checked;
+	struct article *lru_prev;
+	struct article *lru_next;
 } *article;
 
 
 /*
- * Loads or creates a new article database for the given path.
+ * Loads or creates a new article database for the given path. Articles are
+ * indexed by URI in an open-addressing hash table and by date in a sorted
+ * array.
  */
 art_root art_load(const string path);
 
 /*
- * Get the comments by an article
+ * Returns the path of the file the comments of an article are stored in.
+ */
+string art_comment_path(art_root root, const string uri);
+
+/*
+ * Get the comments by an article. The comment file is kept in memory after
+ * it has been read once, see comment_cache_max.
  */
 cinja_list art_get_comments(art_root root, const string uri);
 
 /*
- *
+ * Adds a comment to an article. Returns once the comment is on disk, which
+ * may take up to art_commit_interval milliseconds so that comments posted
+ * at the same time can be written together.
  */
 int art_add_comment(art_root root, const string uri, comment c, size_t reply_to);
 
+/*
+ * The time in milliseconds to wait for more comments before writing them.
+ */
+extern uint art_commit_interval;
+
+/*
+ * Converts comment files in the old text format to the binary format.
+ */
+int art_migrate_comments(art_root root);
+
 /*
  * Frees memory and stores any changes to the database
  */
 void art_free(art_root root);
 
 /*
- * Looks an article up for the given URI and returns it contents if found,
- * otherwise it returns NULL.
+ * Looks up the articles for the given URI. If the URI is (a part of) a date,
+ * e.g. "2018/10", all articles of that period are returned sorted by date.
+ * Otherwise the article with the given URI is returned.
+ *
+ * arts is set to a slice of an array owned by the root. Returns the number of
+ * articles or -1 if the URI is invalid or there is no such article.
  */
-cinja_list art_get(art_root root, const string uri);
+ssize_t art_get(art_root root, const string uri, article **arts);
 
 /*
  * Parse a date in the following format:
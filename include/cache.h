@@ -0,0 +1,108 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include "cstring.h"
+
+
+/*
+ * A cache maps a key (usually a URI) to a response body that was generated
+ * from one or more files. Entries are evicted in LRU order once the combined
+ * size of the bodies exceeds the limit given to cache_create.
+ *
+ * An entry goes stale as soon as one of the files it depends on has a
+ * different mtime, size or inode. To avoid a stat() on every hit, the files
+ * are checked at most once every CACHE_CHECK_INTERVAL seconds.
+ *
+ * A cache may be shared between threads. Entries returned by cache_get and
+ * cache_put stay valid until they are handed back with cache_release, even if
+ * they are evicted in the meantime.
+ */
+
+#define CACHE_CHECK_INTERVAL 1
+
+
+typedef struct cache_dep {
+	string path;
+	time_t mtime;
+	off_t  size;
+	ino_t  ino;
+} cache_dep_t;
+
+typedef struct cache_entry {
+	string key;
+	string body;
+	string mime;
+	int    flags;
+	int    refs;
+	time_t checked;
+	size_t dep_count;
+	struct cache_dep   *deps;
+	struct cache_entry *prev;
+	struct cache_entry *next;
+	struct cache_entry *chain;
+} *cache_entry;
+
+typedef struct cache *cache;
+
+struct cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t count;
+	size_t size;
+	size_t max_size;
+};
+
+
+/*
+ * Creates a new cache that holds at most max_size bytes of bodies.
+ */
+cache cache_create(size_t max_size);
+
+/*
+ * Looks up an entry. NULL is returned if there is no entry or if it went
+ * stale, in which case it is removed.
+ */
+cache_entry cache_get(cache c, const string key);
+
+/*
+ * Copies the body and the dependencies into a new entry, replacing any
+ * existing entry with the same key. The body is given as a number of parts
+ * that are concatenated. Returns NULL if the body is too large or if there is
+ * not enough memory.
+ */
+cache_entry cache_put(cache c, const string key, const string *body, size_t parts,
+                      const string mime, int flags, const struct cache_dep *deps,
+                      size_t dep_count);
+
+/*
+ * Releases an entry returned by cache_get or cache_put.
+ */
+void cache_release(cache c, cache_entry e);
+
+/*
+ * Removes the entry with the given key, if any.
+ */
+void cache_del(cache c, const string key);
+
+/*
+ * Fills in a dependency from a stat buffer. If statbuf is NULL, the file is
+ * expected to not exist.
+ */
+void cache_dep_set(struct cache_dep *dep, const string path, const struct stat *statbuf);
+
+/*
+ * Gets the number of lookups that did and didn't find a fresh entry, as well as
+ * the number of entries and their combined size.
+ */
+void cache_stats(cache c, struct cache_stats *stats);
+
+/*
+ * Frees all entries and the cache itself.
+ */
+void cache_free(cache c);
+
+#endif
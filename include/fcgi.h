@@ -0,0 +1,68 @@
+#ifndef FCGI_H
+#define FCGI_H
+
+#include <stddef.h>
+
+
+/*
+ * A FastCGI responder that runs on an event loop.
+ *
+ * The event loop (fcgi_run) accepts connections, reads records and collects
+ * the parameters and the body of each request. Once a request is complete it
+ * is handed to one of the threads waiting in fcgi_accept. Connections are kept
+ * open if the web server asks for it and may carry any number of requests at
+ * the same time.
+ *
+ * Output is framed in place: small writes are copied into a buffer that
+ * already has room for the record header, larger writes are referenced and
+ * sent straight from the caller's memory.
+ */
+
+typedef struct fcgi_server  *fcgi_server;
+typedef struct fcgi_request *fcgi_request;
+
+
+/*
+ * Creates a server for the given listening socket.
+ */
+fcgi_server fcgi_create(int listen_fd);
+
+/*
+ * Runs the event loop. Takes a fcgi_server so it can be used with
+ * pthread_create.
+ */
+void *fcgi_run(void *server);
+
+/*
+ * Waits for a complete request.
+ */
+fcgi_request fcgi_accept(fcgi_server s);
+
+/*
+ * Gets a parameter of a request, or NULL if it isn't set.
+ */
+const char *fcgi_getparam(fcgi_request r, const char *name);
+
+/*
+ * Reads at most n bytes of the body of a request.
+ */
+size_t fcgi_read(fcgi_request r, char *buf, size_t n);
+
+/*
+ * Writes to the output of a request. Buffers of at least FCGI_COPY_MAX bytes
+ * are not copied and must stay valid until fcgi_flush or fcgi_finish returns.
+ */
+#define FCGI_COPY_MAX 4096
+void fcgi_write(fcgi_request r, const char *buf, size_t n);
+
+/*
+ * Waits until all output that is not copied has been sent.
+ */
+void fcgi_flush(fcgi_request r);
+
+/*
+ * Ends a request and frees it.
+ */
+void fcgi_finish(fcgi_request r);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "cstring.h"
+
+
+/*
+ * File reads for request threads.
+ *
+ * If the kernel supports io_uring, each thread gets a small ring and the read
+ * of a file is submitted together with its close. Otherwise, or if io_uring
+ * is disabled, plain syscalls are used.
+ */
+
+
+/*
+ * Reads a whole file into a temporary string. If statbuf is not NULL, the
+ * size, mtime and inode of the file are filled in. Returns NULL and sets errno
+ * on failure.
+ */
+string file_read(const char *path, struct stat *statbuf);
+
+/*
+ * Reads at most n bytes from the start of an opened file and closes it.
+ */
+ssize_t file_read_close(int fd, char *buf, size_t n);
+
+#endif
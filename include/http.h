@@ -0,0 +1,76 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/*
+ * A minimal HTTP/1.1 server for running without a proxy.
+ *
+ * Like the FastCGI server, an event loop (http_run) reads and parses requests
+ * and hands complete requests to the threads waiting in http_accept. Requests
+ * on a connection are handled one after another, so pipelined requests are
+ * answered in order. A connection that doesn't send a complete request within
+ * 30 seconds, whether it is idle or sends slowly, is closed.
+ *
+ * The request parameters use the same names as CGI (REQUEST_METHOD,
+ * PATH_INFO, QUERY_STRING, HTTP_HOST...) and the output is expected to be a
+ * CGI response, i.e. a "Status:" header instead of a status line. Responses
+ * without a Content-Length are sent chunked.
+ */
+
+typedef struct http_server  *http_server;
+typedef struct http_request *http_request;
+
+
+/*
+ * Creates a server for the given listening socket.
+ */
+http_server http_create(int listen_fd);
+
+/*
+ * Creates a listening socket for an address of the form "host:port",
+ * "[host]:port" or ":port".
+ */
+int http_listen(const char *addr);
+
+/*
+ * Runs the event loop. Takes a http_server so it can be used with
+ * pthread_create.
+ */
+void *http_run(void *server);
+
+/*
+ * Waits for a complete request.
+ */
+http_request http_accept(http_server s);
+
+/*
+ * Gets a parameter of a request, or NULL if it isn't set.
+ */
+const char *http_getparam(http_request r, const char *name);
+
+/*
+ * Reads at most n bytes of the (decoded) body of a request.
+ */
+size_t http_read(http_request r, char *buf, size_t n);
+
+/*
+ * Writes to the output of a request. The data is sent before this returns.
+ */
+void http_write(http_request r, const char *buf, size_t n);
+
+/*
+ * Sends a part of a file with sendfile. Returns -1 if the headers haven't been
+ * written yet or sendfile isn't available (it is only used on Linux), in
+ * which case nothing is sent.
+ */
+int http_sendfile(http_request r, int fd, off_t offset, size_t length);
+
+/*
+ * Ends a request and frees it.
+ */
+void http_finish(http_request r);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cache.h"
+
+
+/*
+ * Request counters and latency histograms.
+ *
+ * Each worker thread records into a slot of its own, so recording needs
+ * neither locks nor atomic read-modify-write instructions. The slots are only
+ * summed up when the metrics are rendered. Threads without a slot don't record
+ * anything.
+ *
+ * Latencies are kept in log-linear histograms like HdrHistogram: every power
+ * of two of microseconds is split into 4 buckets of equal width, so a bucket
+ * is never more than 25% wider than its lower bound.
+ */
+
+enum metrics_method {
+	METRICS_GET,
+	METRICS_HEAD,
+	METRICS_POST,
+	METRICS_OTHER_METHOD,
+	METRICS_METHODS,
+};
+
+enum metrics_route {
+	METRICS_STATIC,
+	METRICS_ARTICLE,
+	METRICS_LIST,
+	METRICS_POST_COMMENT,
+	METRICS_OTHER_ROUTE,
+	METRICS_ROUTES,
+};
+
+
+/*
+ * Allocates a slot for each of n threads.
+ */
+int metrics_init(int n);
+
+/*
+ * Makes the calling thread record into slot id.
+ */
+void metrics_thread(int id);
+
+/*
+ * Adds a cache whose hits and misses are included in the metrics.
+ */
+void metrics_add_cache(const char *name, cache c);
+
+/*
+ * Gets the monotonic time in nanoseconds.
+ */
+uint64_t metrics_now();
+
+/*
+ * Records a finished request. arena is the number of bytes the request took
+ * from the thread's arena.
+ */
+void metrics_request(enum metrics_method method, enum metrics_route route, int status,
+                     uint64_t ns, size_t arena);
+
+/*
+ * Records how long a request waited for its comment to be written.
+ */
+void metrics_comment_write(uint64_t ns);
+
+/*
+ * Renders all metrics in the Prometheus text format. The returned buffer must
+ * be freed.
+ */
+char *metrics_render(size_t *len);
+
+#endif
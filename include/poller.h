@@ -0,0 +1,79 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <sys/socket.h>
+
+
+/*
+ * Readiness events for the event loops of the FastCGI and HTTP servers.
+ *
+ * On Linux this is epoll with edge-triggered events. Elsewhere poll(2) is
+ * used, which reports a socket for as long as it is ready. Either way a loop
+ * reads until EAGAIN. With poll, POLLER_OUT is only watched while
+ * poller_want_write is set for the socket, so an idle connection doesn't wake
+ * the loop all the time.
+ */
+
+#define POLLER_IN  1
+#define POLLER_OUT 2
+// The socket was closed or has an error
+#define POLLER_HUP 4
+
+// Sockets from poller_accept don't raise SIGPIPE where these don't exist
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+# define MSG_MORE 0
+#endif
+
+typedef struct poller *poller;
+
+struct poller_event {
+	void *ptr;
+	int   events;
+};
+
+
+/*
+ * Creates a poller.
+ */
+poller poller_create();
+
+/*
+ * Watches a listening socket, which is reported with a NULL pointer. If the
+ * socket is shared with other processes, only one of them is woken up for a
+ * new connection where the kernel supports it.
+ */
+int poller_add_listener(poller p, int fd);
+
+/*
+ * Watches a socket for the given events. ptr is reported along with them.
+ */
+int poller_add(poller p, int fd, void *ptr, int events);
+
+/*
+ * Stops watching a socket. Must be called before the socket is closed.
+ */
+void poller_del(poller p, int fd);
+
+/*
+ * Sets whether a socket added with POLLER_OUT is waiting to be written to.
+ * Only the poll(2) fallback needs this. May be called from any thread, in
+ * which case poller_wait is woken up.
+ */
+void poller_want_write(poller p, int fd, int want);
+
+/*
+ * Waits at most timeout milliseconds (-1 for ever) for events. Returns the
+ * number of events or -1 on error.
+ */
+int poller_wait(poller p, struct poller_event *events, int n, int timeout);
+
+/*
+ * Accepts a connection as a non-blocking socket that is closed on exec.
+ * Returns -1 and sets errno like accept.
+ */
+int poller_accept(int listen_fd, struct sockaddr *addr, socklen_t *len);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include "cstring.h"
+#include "dict.h"
+
+/*
+ * Copies a field of a query string up to delim or the end of the string and
+ * decodes '+' and percent escapes. *pptr is moved past the delimiter. The
+ * field is allocated with temp_alloc.
+ */
+string copy_query_field(const char **pptr, char delim);
+
+/*
+ * Parses a query string or a form posted as application/x-www-form-urlencoded
+ * into a temporary dictionary.
+ */
+cinja_dict parse_query(const char *q);
+
+#endif
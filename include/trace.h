@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+
+/*
+ * Trace spans that show where the time of a request goes.
+ *
+ * When built with -DSOUP_TRACE, TRACE_BEGIN(name) and TRACE_END(name) record a
+ * span called "name" into a ring buffer of the calling thread. Each thread
+ * keeps its last TRACE_RING_SIZE spans. trace_start_dumper starts a thread
+ * that writes all rings to a Chrome trace event file on SIGUSR1. The file can
+ * be opened with chrome://tracing or Perfetto.
+ *
+ * Without SOUP_TRACE the macros expand to nothing.
+ */
+
+#define TRACE_RING_SIZE 4096
+
+#ifdef SOUP_TRACE
+# define TRACE_BEGIN(name) uint64_t trace_##name = trace_now()
+# define TRACE_END(name)   trace_span(#name, trace_##name)
+
+/*
+ * Gets the monotonic time in nanoseconds.
+ */
+uint64_t trace_now();
+
+/*
+ * Records a span that started at start and ends now.
+ */
+void trace_span(const char *name, uint64_t start);
+
+/*
+ * Starts the thread that dumps the rings on SIGUSR1. Other threads must have
+ * SIGUSR1 blocked, which they inherit from the calling thread if this is
+ * called before they are created.
+ */
+int trace_start_dumper();
+#else
+# define TRACE_BEGIN(name)
+# define TRACE_END(name)
+#endif
+
+#endif
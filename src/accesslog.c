@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+#include "../include/accesslog.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define BUF_SIZE  (1 << 16)
+// The longest line an entry can take, with every byte of the URI escaped
+#define LINE_MAX_LEN (256 + 6 * (ACCESSLOG_URI_MAX + 8))
+// How long the writer sleeps when the rings fill slowly
+#define INTERVAL  1
+
+
+struct entry {
+	int64_t  time_us;
+	uint64_t ns;
+	uint64_t bytes;
+	uint32_t uri_len;
+	uint16_t status;
+	uint8_t  cached;
+	char     method[8];
+	char     uri[ACCESSLOG_URI_MAX];
+};
+
+/*
+ * Only the owning thread moves head and only the writer moves tail, so they
+ * are kept on separate cache lines.
+ */
+struct ring {
+	_Alignas(64) _Atomic size_t head;
+	_Atomic size_t dropped;
+	_Alignas(64) _Atomic size_t tail;
+	size_t reported;
+	struct entry entries[ACCESSLOG_RING_SIZE];
+};
+
+
+static struct ring *rings;
+static int          ring_count;
+static __thread struct ring *local;
+
+static char  *log_path;
+static size_t log_max_size;
+static int    log_files;
+static int    log_fd = -1;
+
+static pthread_t       writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wake = PTHREAD_COND_INITIALIZER;
+static int             stopping;
+
+
+/*
+ * Recording
+ */
+static size_t append(char *dst, size_t at, const char *src)
+{
+	size_t n = strlen(src);
+	if (at < ACCESSLOG_URI_MAX)
+		memcpy(dst + at, src, at + n > ACCESSLOG_URI_MAX ? ACCESSLOG_URI_MAX - at : n);
+	return at + n;
+}
+
+
+void accesslog_request(const char *method, const char *uri, const char *query, int status,
+                       size_t bytes, uint64_t ns, int cached)
+{
+	struct ring *r = local;
+	if (r == NULL)
+		return;
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (head - tail >= ACCESSLOG_RING_SIZE) {
+		atomic_store_explicit(&r->dropped,
+		                      atomic_load_explicit(&r->dropped, memory_order_relaxed) + 1,
+		                      memory_order_relaxed);
+		return;
+	}
+
+	struct entry *e = &r->entries[head % ACCESSLOG_RING_SIZE];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	e->time_us = ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+	e->ns      = ns;
+	e->bytes   = bytes;
+	e->status  = status;
+	e->cached  = cached != 0;
+	strncpy(e->method, method != NULL ? method : "-", sizeof(e->method));
+	size_t n = append(e->uri, 0, uri != NULL ? uri : "");
+	if (query != NULL && *query != 0) {
+		n = append(e->uri, n, "?");
+		n = append(e->uri, n, query);
+	}
+	e->uri_len = n < UINT32_MAX ? n : UINT32_MAX;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+	// Waking the writer early keeps the ring from filling up under load
+	if (head + 1 - tail == ACCESSLOG_RING_SIZE / 2)
+		pthread_cond_signal(&wake);
+}
+
+
+void accesslog_thread(int id)
+{
+	local = id < ring_count ? &rings[id] : NULL;
+}
+
+
+/*
+ * Writing
+ */
+static char *escape(char *out, const char *s, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\') {
+			*out++ = '\\';
+			*out++ = c;
+		} else if (c < 0x20 || c == 0x7f) {
+			out += sprintf(out, "\\u%04x", c);
+		} else {
+			*out++ = c;
+		}
+	}
+	return out;
+}
+
+
+static size_t format_time(char *out, int64_t time_us)
+{
+	static time_t last = -1;
+	static char   prefix[32];
+	time_t sec = time_us / 1000000;
+	// Many entries fall into the same second
+	if (sec != last) {
+		struct tm tm;
+		gmtime_r(&sec, &tm);
+		strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &tm);
+		last = sec;
+	}
+	return sprintf(out, "%s.%03dZ", prefix, (int)(time_us / 1000 % 1000));
+}
+
+
+static size_t format_entry(char *out, const struct entry *e)
+{
+	char *p = out;
+	p += sprintf(p, "{\"time\":\"");
+	p += format_time(p, e->time_us);
+	p += sprintf(p, "\",\"method\":\"");
+	p  = escape(p, e->method, strnlen(e->method, sizeof(e->method)));
+	p += sprintf(p, "\",\"uri\":\"");
+	p  = escape(p, e->uri, e->uri_len < ACCESSLOG_URI_MAX ? e->uri_len : ACCESSLOG_URI_MAX);
+	if (e->uri_len > ACCESSLOG_URI_MAX)
+		p += sprintf(p, "...");
+	p += sprintf(p, "\",\"status\":%u,\"bytes\":%lu,\"duration_us\":%lu,\"cache_hit\":%s}\n",
+	             e->status, (size_t)e->bytes, (size_t)(e->ns / 1000),
+	             e->cached ? "true" : "false");
+	return p - out;
+}
+
+
+static void reopen()
+{
+	int fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("Failed to reopen the access log");
+		return;
+	}
+	close(log_fd);
+	log_fd = fd;
+}
+
+
+/*
+ * Rotates the log if no other process has done so already and reopens it. The
+ * lock keeps processes from rotating at the same time.
+ */
+static void rotate()
+{
+	struct stat ours, theirs;
+	flock(log_fd, LOCK_EX);
+	if (fstat(log_fd, &ours) == 0 && stat(log_path, &theirs) == 0 &&
+	    ours.st_dev == theirs.st_dev && ours.st_ino == theirs.st_ino &&
+	    (size_t)theirs.st_size >= log_max_size) {
+		char from[PATH_MAX], to[PATH_MAX];
+		for (int i = log_files - 1; i > 0; i--) {
+			snprintf(from, sizeof(from), "%s.%d", log_path, i);
+			snprintf(to  , sizeof(to  ), "%s.%d", log_path, i + 1);
+			rename(from, to);
+		}
+		snprintf(to, sizeof(to), "%s.1", log_path);
+		if (rename(log_path, to) < 0)
+			perror("Failed to rotate the access log");
+	}
+	flock(log_fd, LOCK_UN);
+	reopen();
+}
+
+
+static void flush(char *buf, size_t n)
+{
+	static int failing;
+	size_t done = 0;
+	while (done < n) {
+		ssize_t w = write(log_fd, buf + done, n - done);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			// Don't repeat the same error for every batch
+			if (!failing)
+				perror("Failed to write the access log");
+			failing = 1;
+			return;
+		}
+		done += w;
+	}
+	failing = 0;
+
+	// Another process may have rotated the log already, in which case it only
+	// needs to be reopened
+	struct stat ours, theirs;
+	if (log_max_size > 0 && fstat(log_fd, &ours) == 0 &&
+	    ((size_t)ours.st_size >= log_max_size || stat(log_path, &theirs) < 0 ||
+	     ours.st_dev != theirs.st_dev || ours.st_ino != theirs.st_ino))
+		rotate();
+}
+
+
+/*
+ * Formats the entries of a ring into buf, which holds n bytes already. Sets
+ * busy if the ring was at least half full.
+ */
+static size_t drain(struct ring *r, char *buf, size_t n, int *busy)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if (head - tail >= ACCESSLOG_RING_SIZE / 2)
+		*busy = 1;
+	for (; tail != head; tail++) {
+		if (n > BUF_SIZE - LINE_MAX_LEN) {
+			atomic_store_explicit(&r->tail, tail, memory_order_release);
+			flush(buf, n);
+			n = 0;
+		}
+		n += format_entry(buf + n, &r->entries[tail % ACCESSLOG_RING_SIZE]);
+	}
+	// The entries have been copied, so the worker may reuse them
+	atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+	size_t dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+	if (dropped != r->reported) {
+		if (n > BUF_SIZE - LINE_MAX_LEN) {
+			flush(buf, n);
+			n = 0;
+		}
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		n += sprintf(buf + n, "{\"time\":\"");
+		n += format_time(buf + n, ts.tv_sec * 1000000ll + ts.tv_nsec / 1000);
+		n += sprintf(buf + n, "\",\"dropped\":%lu}\n", dropped - r->reported);
+		r->reported = dropped;
+	}
+	return n;
+}
+
+
+static void *write_log(void *arg)
+{
+	char *buf = malloc(BUF_SIZE);
+	if (buf == NULL) {
+		perror("Failed to allocate the access log buffer");
+		return NULL;
+	}
+	for (int stop = 0, busy = 0; !stop; ) {
+		// A worker only wakes the writer once its ring is half full, which
+		// the writer misses while it is writing
+		pthread_mutex_lock(&lock);
+		if (!stopping && !busy) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += INTERVAL;
+			pthread_cond_timedwait(&wake, &lock, &ts);
+		}
+		stop = stopping;
+		pthread_mutex_unlock(&lock);
+
+		size_t n = 0;
+		busy = 0;
+		for (int i = 0; i < ring_count; i++)
+			n = drain(&rings[i], buf, n, &busy);
+		if (n > 0)
+			flush(buf, n);
+	}
+	free(buf);
+	return NULL;
+}
+
+
+/*
+ * Setup
+ */
+int accesslog_open(const char *path, size_t max_size, int files, int n)
+{
+	log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (log_fd < 0)
+		return -1;
+	rings = aligned_alloc(__alignof__(*rings), n * sizeof(*rings));
+	if (rings == NULL)
+		goto fail;
+	memset(rings, 0, n * sizeof(*rings));
+	log_path     = strdup(path);
+	log_max_size = max_size;
+	log_files    = files > 0 ? files : 1;
+	ring_count   = n;
+	stopping     = 0;
+	if (log_path == NULL || pthread_create(&writer, NULL, write_log, NULL) != 0)
+		goto fail;
+	return 0;
+
+fail:
+	free(log_path);
+	free(rings);
+	close(log_fd);
+	log_path   = NULL;
+	rings      = NULL;
+	ring_count = 0;
+	log_fd     = -1;
+	return -1;
+}
+
+
+void accesslog_close()
+{
+	if (log_fd < 0)
+		return;
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+	pthread_join(writer, NULL);
+	close(log_fd);
+	free(log_path);
+	free(rings);
+	log_fd     = -1;
+	log_path   = NULL;
+	rings      = NULL;
+	ring_count = 0;
+}
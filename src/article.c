@@ -1,13 +1,18 @@
 #include "../include/article.h"
+#include "../include/fileio.h"
+#include "../include/metrics.h"
 #include <dirent.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/dir.h>
 #include <sys/fcntl.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <time.h>
 #include "temp-alloc.h"
@@ -43,173 +48,838 @@ static struct date parse_date(string str)
 }
 
 
-/*
- * Comments
- */
+static size_t hash_uri(const string uri)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < uri->len; i++) {
+		h ^= (unsigned char)uri->buf[i];
+		h *= 16777619u;
+	}
+	return h;
+}
 
-static comment parse_comment(const string str)
+
+static article *art_find_slot(art_root root, const string uri)
 {
-	comment c = temp_alloc(sizeof(*c));
-	size_t i = 0, start = i;
-	while (str->buf[i] != '\n')
-		i++;
-	c->author = temp_string_copy(str, start, i);
-	i++;
+	size_t i = hash_uri(uri) & root->index_mask;
+	for (article a; (a = root->index[i]) != NULL; i = (i + 1) & root->index_mask) {
+		if (string_eq(a->uri, uri))
+			return &root->index[i];
+	}
+	return NULL;
+}
 
-	start = i;
-	while (str->buf[i] != '\n')
-		i++;
-	string date = temp_string_copy(str, start, i);
-	c->date = parse_date(date);
-	i++;
 
-	start = i;
-	while (str->buf[i] != '\n')
-		i++;
-	sscanf(str->buf + start, "%d", &c->reply_to);
-	i++;
+static article art_find(art_root root, const string uri)
+{
+	article *slot = art_find_slot(root, uri);
+	return slot != NULL ? *slot : NULL;
+}
 
-	c->body = temp_string_copy(str, i, str->len);
 
-	c->replies = cinja_temp_list_create();
+static int cmp_date(const void *x, const void *y)
+{
+	article a = *(article *)x, b = *(article *)y;
+	if (a->date.num != b->date.num)
+		return a->date.num < b->date.num ? -1 : 1;
+	// Keep the order of the list for articles with the same date
+	return a->position < b->position ? -1 : a->position > b->position;
+}
 
-	return c;
+
+/*
+ * Comments
+ *
+ * Comments are stored in an append-only binary file per article. The file
+ * starts with COMMENT_MAGIC and is followed by records, each consisting of a
+ * fixed header, the author, a NUL, the body and another NUL, padded to a
+ * multiple of 8 bytes. The header contains the lengths of both strings, so
+ * the offset of every record can be found without looking at its contents.
+ *
+ * The records are written in native byte order.
+ */
+
+#define COMMENT_MAGIC     "SOUPCMT1"
+#define COMMENT_MAGIC_LEN 8
+
+struct comment_record {
+	uint32_t id;
+	int32_t  reply_to;
+	uint64_t date;
+	uint32_t author_len;
+	uint32_t body_len;
+};
+
+
+static int is_comment_file(const string str)
+{
+	return str->len >= COMMENT_MAGIC_LEN && memcmp(str->buf, COMMENT_MAGIC, COMMENT_MAGIC_LEN) == 0;
 }
 
 
-cinja_list art_get_comments(art_root root, const string name)
+static size_t record_size(const struct comment_record *h)
 {
-	const char **entries  = NULL;
-	comment     *comments = NULL;
-	cinja_list  ls        = NULL;
+	size_t s = sizeof(*h) + h->author_len + 1 + h->body_len + 1;
+	return (s + 7) & ~(size_t)7;
+}
 
-	string file_components[3] = { root->dir, comment_path_component, name };
-	string file = temp_string_concat(file_components, 3);
-	FILE *f = fopen(file->buf, "r");
-	string str;
-	if (f == NULL) {
-		str = temp_string_create("");
-	} else {
-		fseek(f, 0, SEEK_END);
-		size_t s = ftell(f);
-		fseek(f, 0, SEEK_SET);
-		str = temp_alloc(sizeof(str->len) + s + 1);
-		fread(str->buf, 1, s, f);
-		str->buf[s] = 0;
-		str->len = s;
-		fclose(f);
-	}
 
-	cinja_list cs = cinja_temp_list_create();
-	size_t i = 0;
-	for (int id = 0; i < str->len; id++) {
-		while (str->buf[i] == '\n')
-			i++;
-		size_t start = i;
-		while (1) {
-			if (memcmp(&str->buf[i], "\n\n\n", 3) == 0)
-				break;
-			if (i >= str->len)
-				goto done;
-			i++;
+/*
+ * Escapes '<' and '>'. At most keep_nl consecutive newlines are kept and
+ * trailing newlines are dropped. dst must be able to hold 4 times the length
+ * of src.
+ */
+static size_t escape(char *dst, const string src, int keep_nl)
+{
+	size_t n = 0;
+	int nc = 0;
+	for (size_t i = 0; i < src->len; i++) {
+		char x = src->buf[i];
+		switch (x) {
+		default : dst[n++] = x; nc = 0; break;
+		case '<': memcpy(dst + n, "&lt;", 4); n += 4; nc = 0; break;
+		case '>': memcpy(dst + n, "&gt;", 4); n += 4; nc = 0; break;
+		case '\n':
+			nc++;
+			if (nc <= keep_nl)
+				dst[n++] = '\n';
+			break;
 		}
-		string cstr = string_copy(str, start, i);
-		comment c = parse_comment(cstr);
-		free(cstr);
-		c->id = id;
-		cinja_list_add(cs, c);
-		i++;
 	}
-done:
-	ls = cinja_temp_list_create(sizeof(comment));
+	while (n > 0 && dst[n - 1] == '\n')
+		n--;
+	return n;
+}
+
+
+/*
+ * Turns a flat list of comments into a tree. Comments with an invalid
+ * reply_to are dropped.
+ */
+static cinja_list build_tree(cinja_list cs)
+{
+	cinja_list ls = cinja_temp_list_create(sizeof(comment));
 	for (size_t i = 0; i < cs->count; i++) {
 		comment c = cinja_list_get(cs, i).item;
 		cinja_list l;
 		if (c->reply_to == -1) {
 			l = ls;
-		} else {
+		} else if (c->reply_to >= 0 && c->reply_to < c->id) {
 			comment d = cinja_list_get(cs, c->reply_to).item;
 			l = d->replies;
+		} else {
+			continue;
 		}
 		if (cinja_list_add(l, c) < 0)
+			return NULL;
+	}
+	return ls;
+}
+
+
+/*
+ * Reads a whole file into a temporary string. If the file doesn't exist an
+ * empty string is returned.
+ */
+static string read_file(const string path)
+{
+	string str = file_read(path->buf, NULL);
+	if (str == NULL && errno == ENOENT)
+		return temp_string_create("");
+	return str;
+}
+
+
+static cinja_list parse_text_comments(const string str);
+
+
+/*
+ * Parses the records in a binary comment file. Parsing stops at the first
+ * truncated or inconsistent record.
+ */
+static cinja_list parse_comments(const string str)
+{
+	cinja_list cs = cinja_temp_list_create();
+	if (!is_comment_file(str))
+		return cs;
+	size_t off = COMMENT_MAGIC_LEN;
+	for (uint32_t id = 0; off + sizeof(struct comment_record) <= str->len; id++) {
+		struct comment_record h;
+		memcpy(&h, str->buf + off, sizeof(h));
+		if (h.id != id || off + record_size(&h) > str->len)
+			break;
+		const char *p = str->buf + off + sizeof(h);
+		comment c   = temp_alloc(sizeof(*c));
+		c->id       = id;
+		c->reply_to = h.reply_to;
+		c->date.num = h.date;
+		c->author   = temp_string_create(p, h.author_len);
+		c->body     = temp_string_create(p + h.author_len + 1, h.body_len);
+		c->replies  = cinja_temp_list_create();
+		cinja_list_add(cs, c);
+		off += record_size(&h);
+	}
+	return cs;
+}
+
+
+/*
+ * Finds the end of the last record that parse_comments would accept by
+ * hopping from header to header. count is set to the number of records before
+ * it. Returns 0 if buf doesn't start with the magic.
+ */
+static size_t scan_comments(const char *buf, size_t len, uint32_t *count)
+{
+	*count = 0;
+	if (len < COMMENT_MAGIC_LEN || memcmp(buf, COMMENT_MAGIC, COMMENT_MAGIC_LEN) != 0)
+		return 0;
+	size_t off = COMMENT_MAGIC_LEN;
+	while (off + sizeof(struct comment_record) <= len) {
+		struct comment_record h;
+		memcpy(&h, buf + off, sizeof(h));
+		if (h.id != *count || off + record_size(&h) > len)
+			break;
+		off += record_size(&h);
+		(*count)++;
+	}
+	return off;
+}
+
+
+/*
+ * Reads an opened comment file and scans it like scan_comments. size is set to
+ * the size of the file. A file that is empty or was cut off within the magic
+ * holds no records, so 0 is returned for it. Files in the old format are an
+ * error.
+ */
+static ssize_t scan_comment_file(int fd, size_t *size, uint32_t *count)
+{
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) < 0)
+		return -1;
+	size_t len = statbuf.st_size, n = 0;
+	char *buf = malloc(len + 1);
+	if (buf == NULL)
+		return -1;
+	while (n < len) {
+		ssize_t r = pread(fd, buf + n, len - n, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			free(buf);
+			return -1;
+		}
+		if (r == 0)
+			break;
+		n += r;
+	}
+	size_t end = scan_comments(buf, n, count);
+	int old = end == 0 && (n >= COMMENT_MAGIC_LEN || memcmp(buf, COMMENT_MAGIC, n) != 0);
+	free(buf);
+	if (old) {
+		errno = EINVAL;
+		return -1;
+	}
+	*size = n;
+	return end;
+}
+
+
+/*
+ * Cuts off what is left of a record that was written partially, unless the
+ * file is being written to right now. In that case the writer does it.
+ */
+static void repair_comments(const string file)
+{
+	int fd = open(file->buf, O_RDWR);
+	if (fd < 0)
+		return;
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+		size_t size;
+		uint32_t count;
+		ssize_t end = scan_comment_file(fd, &size, &count);
+		if (end > 0 && (size_t)end < size && ftruncate(fd, end) == 0)
+			fprintf(stderr, "Cut off a partial comment at the end of '%s'\n", file->buf);
+	}
+	close(fd);
+}
+
+
+/*
+ * Encodes a comment as a record. The author's name is stripped of newlines
+ * and consecutive newlines in the body are trimmed.
+ */
+static string encode_comment(int id, comment c, size_t reply_to)
+{
+	size_t max = sizeof(struct comment_record) + (c->author->len + c->body->len) * 4 + 16;
+	string rec = temp_alloc(sizeof(rec->len) + max);
+	if (rec == NULL)
+		return NULL;
+	struct comment_record h = {
+		.id       = id,
+		.reply_to = reply_to,
+		.date     = c->date.num,
+	};
+	char *p = rec->buf + sizeof(h);
+	h.author_len = escape(p, c->author, 0);
+	p[h.author_len] = 0;
+	p += h.author_len + 1;
+	h.body_len = escape(p, c->body, 2);
+	p[h.body_len] = 0;
+	memcpy(rec->buf, &h, sizeof(h));
+	rec->len = record_size(&h);
+	memset(p + h.body_len + 1, 0, rec->buf + rec->len - (p + h.body_len + 1));
+	return rec;
+}
+
+
+/*
+ * Appends records to a file and waits until they are on disk. If the file
+ * is empty, the magic is written first.
+ *
+ * Other processes may append to the same file, so it is locked while it is
+ * written and the records are numbered after the last record in the file
+ * rather than by the IDs they were encoded with. Returns the ID of the first
+ * record.
+ *
+ * Anything after the last complete record was left by a write that failed or
+ * was cut short by a crash. It is cut off before appending, as are the records
+ * of a failed append, so later records are never hidden behind a broken one.
+ */
+static int append_comments(const string file, string *recs, size_t count)
+{
+	int fd = open(file->buf, O_RDWR | O_APPEND | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+	if (flock(fd, LOCK_EX) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	// Files in the old format have to be migrated first
+	size_t size;
+	uint32_t id;
+	ssize_t end = scan_comment_file(fd, &size, &id);
+	if (end < 0) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t)end < size && ftruncate(fd, end) < 0)
+		goto error;
+	int empty = end == 0;
+
+	for (size_t i = 0; i < count; i++) {
+		struct comment_record h;
+		memcpy(&h, recs[i]->buf, sizeof(h));
+		h.id = id + i;
+		memcpy(recs[i]->buf, &h, sizeof(h));
+	}
+
+	struct iovec iov[64];
+	size_t i = 0, n = 0, len = 0;
+	if (empty) {
+		iov[n].iov_base = COMMENT_MAGIC;
+		iov[n].iov_len  = COMMENT_MAGIC_LEN;
+		len += iov[n++].iov_len;
+	}
+	while (i < count || n > 0) {
+		while (i < count && n < sizeof(iov) / sizeof(*iov)) {
+			iov[n].iov_base = recs[i]->buf;
+			iov[n].iov_len  = recs[i]->len;
+			len += iov[n++].iov_len;
+			i++;
+		}
+		if (writev(fd, iov, n) != (ssize_t)len)
 			goto error;
+		n = len = 0;
+	}
+	if (fdatasync(fd) < 0)
+		goto error;
+	// This releases the lock too
+	close(fd);
+
+	// Make sure a new file itself survives a crash too
+	if (empty) {
+		char *slash = strrchr(file->buf, '/');
+		string dir = slash != NULL ? temp_string_create(file->buf, slash - file->buf)
+		                           : temp_string_create(".");
+		int dfd = open(dir->buf, O_RDONLY);
+		if (dfd >= 0) {
+			fsync(dfd);
+			close(dfd);
+		}
 	}
+	return id;
 
-	goto success;
 error:
-	if (ls != NULL)
-		cinja_list_free(ls);
-	ls = NULL;
-success:
-	free(entries);
-	free(comments);
-	return ls;
+	// Don't leave a partial record behind
+	if (ftruncate(fd, end) < 0)
+		perror("Failed to cut off a failed comment");
+	close(fd);
+	return -1;
 }
 
 
-int art_add_comment(art_root root, const string uri, comment c, size_t reply_to)
+/*
+ * Group commit
+ *
+ * Comments are appended by a single writer thread. When a comment is queued
+ * the writer waits commit_interval milliseconds for other comments to come in
+ * and then writes all of them with one writev() and one fdatasync() per file.
+ * The request that posted a comment waits until its batch is on disk.
+ *
+ * The writer is started when the first comment is posted, so it is started in
+ * the process that needs it when prefork is used.
+ */
+
+struct commit {
+	string file;
+	string rec;
+	int    ret;
+	int    written;
+	int    done;
+	struct commit *next;
+};
+
+uint art_commit_interval = 10;
+
+static pthread_mutex_t commit_lock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  commit_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  commit_done   = PTHREAD_COND_INITIALIZER;
+static struct commit  *commit_head   = NULL;
+static struct commit **commit_tail   = &commit_head;
+static int             commit_running;
+
+
+static void write_batch(struct commit *batch)
 {
-	// Search for the article
-	for (size_t i = 0; i < root->articles->count; i++) {
-		article a = cinja_list_get(root->articles, i).item;
-		if (string_eq(a->uri, uri))
-			goto found;
+	for (struct commit *c = batch; c != NULL; c = c->next)
+		c->written = 0;
+
+	// Write the records of each file in the order they were queued
+	size_t max = 0;
+	for (struct commit *c = batch; c != NULL; c = c->next)
+		max++;
+	string *recs = temp_alloc(max * sizeof(*recs));
+	for (struct commit *c = batch; c != NULL; c = c->next) {
+		if (c->written)
+			continue;
+		size_t n = 0;
+		for (struct commit *d = c; d != NULL; d = d->next) {
+			if (!d->written && string_eq(d->file, c->file))
+				recs[n++] = d->rec;
+		}
+		int id = append_comments(c->file, recs, n);
+		for (struct commit *d = c; d != NULL; d = d->next) {
+			if (!d->written && string_eq(d->file, c->file)) {
+				d->ret     = id < 0 ? id : id++;
+				d->written = 1;
+			}
+		}
 	}
-	return -1;
+}
 
-found:;
-	// Open the comment file
-	string file_components[3] = { root->dir, comment_path_component, uri };
-	string file = temp_string_concat(file_components, 3);
-	FILE *f = fopen(file->buf, "a");
-	if (f == NULL) {
-		f = fopen(file->buf, "w");
-		if (f == NULL)
-			return -1;
+
+static void *commit_thread(void *arg)
+{
+	temp_alloc_push(1 << 20);
+	pthread_mutex_lock(&commit_lock);
+	while (1) {
+		while (commit_head == NULL)
+			pthread_cond_wait(&commit_queued, &commit_lock);
+
+		// Give concurrent requests a chance to join the batch
+		pthread_mutex_unlock(&commit_lock);
+		struct timespec ts = {
+			.tv_sec  =  art_commit_interval / 1000,
+			.tv_nsec = (art_commit_interval % 1000) * 1000000,
+		};
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&commit_lock);
+
+		struct commit *batch = commit_head;
+		commit_head = NULL;
+		commit_tail = &commit_head;
+		pthread_mutex_unlock(&commit_lock);
+
+		write_batch(batch);
+		temp_alloc_reset();
+
+		pthread_mutex_lock(&commit_lock);
+		for (struct commit *c = batch, *next; c != NULL; c = next) {
+			// The commit lives on the stack of the waiting request
+			next = c->next;
+			c->done = 1;
+		}
+		pthread_cond_broadcast(&commit_done);
 	}
-	struct date d = c->date;
+	return NULL;
+}
 
-	// Write the author's name (without newlines)
-	for (size_t i = 0; i < c->author->len; i++) {
-		char x = c->author->buf[i];
-		switch (x) {
-		default  : fputc(x     , f); break;
-		case  '<': fputs("&lt;", f); break;
-		case  '>': fputs("&gt;", f); break;
-		case '\n': break;
+
+/*
+ * Queues a record and waits until it has been written. Returns the ID it was
+ * written with.
+ */
+static int commit_comment(const string file, const string rec)
+{
+	struct commit c = { .file = file, .rec = rec, .done = 0, .next = NULL };
+
+	pthread_mutex_lock(&commit_lock);
+	if (!commit_running) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, commit_thread, NULL) != 0) {
+			pthread_mutex_unlock(&commit_lock);
+			string recs[1] = { rec };
+			return append_comments(file, recs, 1);
 		}
+		pthread_detach(thread);
+		commit_running = 1;
 	}
-	fputc('\n', f);
+	*commit_tail = &c;
+	commit_tail  = &c.next;
+	pthread_cond_signal(&commit_queued);
+	while (!c.done)
+		pthread_cond_wait(&commit_done, &commit_lock);
+	pthread_mutex_unlock(&commit_lock);
 
-	// Write the date and reply ID
-	fprintf(f,
-	        "%u-%u-%u %u:%u\n"
-	        "%ld\n",
-	        d.year, d.month, d.day, d.hour, d.min,
-	        reply_to);
+	return c.ret;
+}
 
-	// Write the body with trimmed newlines
-	int nc = 0;
-	for (size_t i = 0; i < c->body->len; i++) {
-		char x = c->body->buf[i];
-		switch (x) {
-		default : fputc(x     , f); nc = 0; break;
-		case '<': fputs("&lt;", f); nc = 0; break;
-		case '>': fputs("&gt;", f); nc = 0; break;
-		case '\n':
-			nc++;
-			if (nc <= 2)
-				fputc('\n', f);
-			break;
+
+/*
+ * Comment cache
+ *
+ * The contents of the comment files of recently viewed articles are kept in
+ * memory, so showing comments doesn't need to read the file again. New
+ * comments are appended to both the file and the cached copy. To pick up
+ * changes made by other processes, the size of the file is compared with the
+ * cached copy at most once every COMMENT_CHECK_INTERVAL seconds. A comment
+ * that was numbered differently by the writer, or that couldn't be written,
+ * marks the copy as stale, and it is dropped once no more comments are
+ * pending.
+ *
+ * If the cache grows beyond comment_cache_max bytes the copies of the least
+ * recently used articles are dropped. The cached copy of an article is
+ * protected by the article's lock; the LRU list by the root's lock.
+ */
+
+#define COMMENT_CHECK_INTERVAL 1
+
+
+static void lru_unlink(art_root root, article a)
+{
+	if (a->lru_prev != NULL)
+		a->lru_prev->lru_next = a->lru_next;
+	else
+		root->lru_head = a->lru_next;
+	if (a->lru_next != NULL)
+		a->lru_next->lru_prev = a->lru_prev;
+	else
+		root->lru_tail = a->lru_prev;
+	a->lru_prev = a->lru_next = NULL;
+}
+
+
+static void lru_push(art_root root, article a)
+{
+	a->lru_prev = NULL;
+	a->lru_next = root->lru_head;
+	if (root->lru_head != NULL)
+		root->lru_head->lru_prev = a;
+	else
+		root->lru_tail = a;
+	root->lru_head = a;
+}
+
+
+/*
+ * Drops the cached comments of an article. The article must be locked.
+ */
+static void uncache_comments(art_root root, article a)
+{
+	if (a->comments == NULL)
+		return;
+	pthread_mutex_lock(&root->lru_lock);
+	lru_unlink(root, a);
+	root->comment_cache_size -= a->comments->len;
+	pthread_mutex_unlock(&root->lru_lock);
+	free(a->comments);
+	a->comments = NULL;
+}
+
+
+/*
+ * Marks the comments of an article as recently used and accounts for a
+ * change in their size. Articles that haven't been used in a while are
+ * evicted if the cache is too large. The article must be locked.
+ */
+static void touch_comments(art_root root, article a, ssize_t delta)
+{
+	pthread_mutex_lock(&root->lru_lock);
+	if (a->lru_prev != NULL || root->lru_head == a)
+		lru_unlink(root, a);
+	lru_push(root, a);
+	root->comment_cache_size += delta;
+	for (article v = root->lru_tail; v != NULL && v != a &&
+	     root->comment_cache_size > root->comment_cache_max; ) {
+		article prev = v->lru_prev;
+		// Skip articles that are in use to avoid lock order inversions
+		if (pthread_mutex_trylock(&v->lock) == 0) {
+			if (v->comments_pending == 0) {
+				lru_unlink(root, v);
+				root->comment_cache_size -= v->comments->len;
+				free(v->comments);
+				v->comments = NULL;
+			}
+			pthread_mutex_unlock(&v->lock);
 		}
+		v = prev;
 	}
+	pthread_mutex_unlock(&root->lru_lock);
+}
 
-	// Write the delimiter
-	for (size_t i = nc; i <= 3; i++)
-		fputc('\n', f);
 
-	// Done
-	fclose(f);
+/*
+ * Makes sure the cached copy of the comments of an article is up to date.
+ * The article must be locked.
+ */
+static int load_comments(art_root root, article a)
+{
+	time_t now = time(NULL);
+	if (a->comments != NULL) {
+		// The file is behind the copy while comments are being written
+		if (now - a->comments_checked < COMMENT_CHECK_INTERVAL || a->comments_pending > 0)
+			return 0;
+		struct stat statbuf;
+		string file = art_comment_path(root, a->uri);
+		off_t size = stat(file->buf, &statbuf) < 0 ? 0 : statbuf.st_size;
+		if (size == (off_t)a->comments->len) {
+			a->comments_checked = now;
+			return 0;
+		}
+		uncache_comments(root, a);
+	}
+
+	string file = art_comment_path(root, a->uri);
+	string str  = read_file(file);
+	if (str == NULL)
+		return -1;
+	// A partial record at the end would otherwise stay until the next comment
+	uint32_t count;
+	size_t end = scan_comments(str->buf, str->len, &count);
+	if (end > 0 && end < str->len) {
+		repair_comments(file);
+		str->len = end;
+	}
+	// A file cut off within the magic holds no comments yet
+	if (end == 0 && str->len < COMMENT_MAGIC_LEN &&
+	    memcmp(str->buf, COMMENT_MAGIC, str->len) == 0)
+		str->len = 0;
+	a->comments = string_copy(str, 0, str->len);
+	if (a->comments == NULL)
+		return -1;
+	a->comment_count    = count;
+	a->comments_checked = now;
+	touch_comments(root, a, a->comments->len);
+	return 0;
+}
+
+
+string art_comment_path(art_root root, const string uri)
+{
+	string file_components[3] = { root->dir, comment_path_component, uri };
+	return temp_string_concat(file_components, 3);
+}
+
+
+cinja_list art_get_comments(art_root root, const string name)
+{
+	article a = art_find(root, name);
+	if (a == NULL)
+		return NULL;
+
+	cinja_list cs = NULL;
+	pthread_mutex_lock(&a->lock);
+	if (load_comments(root, a) == 0) {
+		// Files that haven't been migrated yet are still shown
+		if (a->comments->len == 0 || is_comment_file(a->comments))
+			cs = parse_comments(a->comments);
+		else
+			cs = parse_text_comments(a->comments);
+		touch_comments(root, a, 0);
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return cs != NULL ? build_tree(cs) : NULL;
+}
+
+
+int art_add_comment(art_root root, const string uri, comment c, size_t reply_to)
+{
+	// Search for the article
+	article a = art_find(root, uri);
+	if (a == NULL)
+		return -1;
+
+	int ret = -1;
+	pthread_mutex_lock(&a->lock);
+	if (load_comments(root, a) < 0)
+		goto done;
+	if (a->comments->len > 0 && !is_comment_file(a->comments)) {
+		fprintf(stderr, "Comments of '%s' are in the old format, run 'soup migrate-comments'\n",
+		        uri->buf);
+		goto done;
+	}
+	if (reply_to != (size_t)-1 && reply_to >= (size_t)a->comment_count)
+		goto done;
+
+	int id = a->comment_count;
+	string rec = encode_comment(id, c, reply_to);
+	if (rec == NULL)
+		goto done;
+
+	// Update the cached copy right away so the IDs of comments posted while
+	// this one is being written follow this one's
+	size_t old = a->comments->len;
+	size_t add = (old == 0 ? COMMENT_MAGIC_LEN : 0) + rec->len;
+	string str = realloc(a->comments, sizeof(str->len) + old + add + 1);
+	if (str == NULL)
+		goto done;
+	if (old == 0)
+		memcpy(str->buf, COMMENT_MAGIC, COMMENT_MAGIC_LEN);
+	memcpy(str->buf + str->len + add - rec->len, rec->buf, rec->len);
+	str->len += add;
+	str->buf[str->len] = 0;
+	a->comments = str;
+	a->comment_count++;
+	a->comments_pending++;
+	touch_comments(root, a, add);
+	pthread_mutex_unlock(&a->lock);
+
+	uint64_t start = metrics_now();
+	ret = commit_comment(art_comment_path(root, uri), rec);
+	metrics_comment_write(metrics_now() - start);
+
+	pthread_mutex_lock(&a->lock);
+	a->comments_pending--;
+	if (ret < 0 && a->comments->len == old + add && a->comment_count == id + 1) {
+		// Nothing was added after the comment, so it can be taken out again
+		a->comments->len = old;
+		a->comments->buf[old] = 0;
+		a->comment_count--;
+		touch_comments(root, a, -(ssize_t)add);
+	} else if (ret != id) {
+		// The copy no longer matches the file if the comment wasn't written or
+		// got another ID, e.g. because another process added a comment too
+		a->comments_stale = 1;
+	}
+	if (a->comments_stale && a->comments_pending == 0) {
+		uncache_comments(root, a);
+		a->comments_stale = 0;
+	}
+
+done:
+	pthread_mutex_unlock(&a->lock);
+	return ret < 0 ? -1 : 0;
+}
+
+
+/*
+ * Migration from the old text format
+ *
+ * Each comment used to be stored as the author, the date and the ID of the
+ * comment it replies to on separate lines, followed by the body and delimited
+ * by (at least) three newlines.
+ */
+
+/*
+ * Copies the line starting at *i and moves *i past its newline. Comments cut
+ * short end in empty lines.
+ */
+static string next_line(const string str, size_t *i)
+{
+	size_t start = *i;
+	while (*i < str->len && str->buf[*i] != '\n')
+		(*i)++;
+	string line = temp_string_copy(str, start, *i);
+	if (*i < str->len)
+		(*i)++;
+	return line;
+}
+
+
+static comment parse_text_comment(const string str)
+{
+	comment c = temp_alloc(sizeof(*c));
+	size_t i = 0;
+	c->author = next_line(str, &i);
+	c->date   = parse_date(next_line(str, &i));
+	c->reply_to = -1;
+	sscanf(next_line(str, &i)->buf, "%d", &c->reply_to);
+	c->body = temp_string_copy(str, i, str->len);
+
+	c->replies = cinja_temp_list_create();
+
+	return c;
+}
+
+
+static cinja_list parse_text_comments(const string str)
+{
+	cinja_list cs = cinja_temp_list_create();
+	size_t i = 0;
+	for (int id = 0; i < str->len; id++) {
+		while (i < str->len && str->buf[i] == '\n')
+			i++;
+		size_t start = i;
+		while (1) {
+			if (i + 3 > str->len)
+				return cs;
+			if (memcmp(&str->buf[i], "\n\n\n", 3) == 0)
+				break;
+			i++;
+		}
+		string cstr = temp_string_copy(str, start, i);
+		comment c = parse_text_comment(cstr);
+		c->id = id;
+		cinja_list_add(cs, c);
+		i++;
+	}
+	return cs;
+}
+
+
+int art_migrate_comments(art_root root)
+{
+	for (size_t i = 0; i < root->articles->count; i++) {
+		article a = cinja_list_get(root->articles, i).item;
+		string file = art_comment_path(root, a->uri);
+		string str  = read_file(file);
+		if (str == NULL)
+			return -1;
+		if (str->len == 0 || is_comment_file(str))
+			continue;
+
+		// Write the new file next to the old one and swap them
+		string components[2] = { file, temp_string_create(".new") };
+		string tmp = temp_string_concat(components, 2);
+		unlink(tmp->buf);
+		cinja_list cs = parse_text_comments(str);
+		string *recs = temp_alloc(cs->count * sizeof(*recs));
+		for (size_t j = 0; j < cs->count; j++) {
+			comment c = cinja_list_get(cs, j).item;
+			recs[j] = encode_comment(j, c, c->reply_to);
+			if (recs[j] == NULL)
+				return -1;
+		}
+		if (append_comments(tmp, recs, cs->count) < 0)
+			return -1;
+		if (rename(tmp->buf, file->buf) < 0)
+			return -1;
+		printf("Migrated %lu comments of '%s'\n", cs->count, a->uri->buf);
+	}
 	return 0;
 }
 
@@ -221,13 +891,18 @@ found:;
 static string copy_art_field(char **pptr)
 {
 	char *ptr = *pptr;
-	while (*ptr != '"')
+	while (*ptr != '"') {
+		if (*ptr == 0)
+			return NULL;
 		ptr++;
+	}
 	ptr++;
 	char *p = ptr;
 	while (*ptr != '"') {
 		if (*ptr == '\\')
 			ptr++;
+		if (*ptr == 0)
+			return NULL;
 		ptr++;
 	}
 	*ptr = 0;
@@ -248,6 +923,12 @@ art_root art_load(const string path)
 		free(root);
 		return NULL;
 	}
+	root->lru_head = NULL;
+	root->lru_tail = NULL;
+	root->comment_cache_size = 0;
+	root->comment_cache_max  = 1 << 24;
+	pthread_mutex_init(&root->lru_lock, NULL);
+
 	root->dir->len = path->len + 1;
 	memcpy(root->dir->buf, path->buf, path->len);
 	root->dir->buf[path->len+0] = '/';
@@ -258,19 +939,44 @@ art_root art_load(const string path)
 	memcpy(buf + path->len, ".list", sizeof(".list"));
 
 	cinja_list arts = cinja_list_create(sizeof(article));
+	root->articles = arts;
+	root->index    = NULL;
+	root->by_date  = NULL;
 	FILE *f = fopen(buf, "r");
+	if (f == NULL) {
+		art_free(root);
+		return NULL;
+	}
 	article prev = NULL;
 	while (fgets(buf, sizeof(buf), f) != NULL) {
 		if (buf[0] == '\n')
 			continue;
-		article a   = malloc(sizeof(*a));
 		char *ptr   = buf;
-		a->title    = copy_art_field(&ptr);
-		string date = copy_art_field(&ptr);
+		string title = copy_art_field(&ptr);
+		string date  = copy_art_field(&ptr);
+		string file  = copy_art_field(&ptr);
+		string uri   = copy_art_field(&ptr);
+		if (title == NULL || date == NULL || file == NULL || uri == NULL) {
+			// Skip malformed (e.g. half-written) entries
+			free(title);
+			free(date);
+			free(file);
+			free(uri);
+			continue;
+		}
+		article a   = malloc(sizeof(*a));
+		a->title    = title;
 		a->date     = parse_date(date);
 		free(date);
-		a->file     = copy_art_field(&ptr);
-		a->uri      = copy_art_field(&ptr);
+		a->file     = file;
+		a->uri      = uri;
+		a->position = arts->count;
+		a->comments = NULL;
+		a->comments_pending = 0;
+		a->comments_stale   = 0;
+		a->lru_prev = NULL;
+		a->lru_next = NULL;
+		pthread_mutex_init(&a->lock, NULL);
 		a->prev = prev;
 		if (prev != NULL)
 			prev->next = a;
@@ -278,8 +984,39 @@ art_root art_load(const string path)
 		prev = a;
 	}
 	fclose(f);
-	prev->next = NULL;
-	root->articles = arts;
+	if (prev != NULL)
+		prev->next = NULL;
+
+	// Build the URI index. It is kept at most half full so probe
+	// sequences stay short.
+	size_t n = 16;
+	while (n < arts->count * 2)
+		n *= 2;
+	root->index      = calloc(n, sizeof(*root->index));
+	root->index_mask = n - 1;
+	if (root->index == NULL) {
+		art_free(root);
+		return NULL;
+	}
+	for (size_t i = 0; i < arts->count; i++) {
+		article a = cinja_list_get(arts, i).item;
+		size_t  j = hash_uri(a->uri) & root->index_mask;
+		// If a URI is listed twice, the first entry wins
+		while (root->index[j] != NULL && !string_eq(root->index[j]->uri, a->uri))
+			j = (j + 1) & root->index_mask;
+		if (root->index[j] == NULL)
+			root->index[j] = a;
+	}
+
+	// Build the date index
+	root->by_date = malloc((arts->count + 1) * sizeof(*root->by_date));
+	if (root->by_date == NULL) {
+		art_free(root);
+		return NULL;
+	}
+	for (size_t i = 0; i < arts->count; i++)
+		root->by_date[i] = cinja_list_get(arts, i).item;
+	qsort(root->by_date, arts->count, sizeof(*root->by_date), cmp_date);
 
 	return root;
 }
@@ -293,24 +1030,44 @@ void art_free(art_root root)
 		free(a->title);
 		free(a->file);
 		free(a->uri);
+		free(a->comments);
+		pthread_mutex_destroy(&a->lock);
 		free(a);
 	}
 	cinja_list_free(root->articles);
+	free(root->index);
+	free(root->by_date);
+	pthread_mutex_destroy(&root->lru_lock);
 	free(root);
 }
 
 /*
  * Article
  */
-static cinja_list art_get_between_times(art_root root, struct date min, struct date max)
+/*
+ * Returns the index of the first article in by_date that is not older than
+ * the given date.
+ */
+static size_t lower_bound(art_root root, struct date date)
 {
-	cinja_list arts = cinja_temp_list_create(sizeof(article));
-	for (size_t i = 0; i < root->articles->count; i++) {
-		article a = cinja_list_get(root->articles, i).item;
-		if (min.num <= a->date.num && a->date.num < max.num)
-			cinja_list_add(arts, a);
+	size_t lo = 0, hi = root->articles->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (root->by_date[mid]->date.num < date.num)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return arts;
+	return lo;
+}
+
+
+static size_t art_get_between_times(art_root root, struct date min, struct date max, article **arts)
+{
+	size_t start = lower_bound(root, min);
+	size_t end   = lower_bound(root, max);
+	*arts = &root->by_date[start];
+	return end - start;
 }
 
 
@@ -365,7 +1122,8 @@ static int uri_to_dates(struct date *min, struct date *max, const char *uri)
 		return 0;
 	if (*ptr != '/')
 		return -1;
-	
+	ptr++;
+
 	min->month = max->month = parse_uint(&ptr);
 	if (*ptr == 0)
 		return 0;
@@ -373,6 +1131,7 @@ static int uri_to_dates(struct date *min, struct date *max, const char *uri)
 		return -1;
 	if (min->month < 1 || min->month > 12)
 		return -1;
+	ptr++;
 
 	min->day = max->day = parse_uint(&ptr);
 	if (*ptr == 0)
@@ -390,24 +1149,14 @@ static int uri_to_dates(struct date *min, struct date *max, const char *uri)
 }
 
 
-cinja_list art_get(art_root root, const string uri) {
+ssize_t art_get(art_root root, const string uri, article **arts) {
 	if (uri->buf[0] == 0 || ('0' <= uri->buf[0] && uri->buf[0] <= '9')) {
 		struct date min, max;
 		if (uri_to_dates(&min, &max, uri->buf) < 0)
-			return NULL;
-		return art_get_between_times(root, min, max);
+			return -1;
+		return art_get_between_times(root, min, max, arts);
 	} else {
-		article *arts = temp_alloc(sizeof(*arts));
-		article  art  = arts[0] = temp_alloc(sizeof(*art));
-
-		for (size_t i = 0; i < root->articles->count; i++) {
-			article a = cinja_list_get(root->articles, i).item;
-			if (string_eq(a->uri, uri)) {
-				cinja_list l = cinja_temp_list_create(sizeof(a));
-				cinja_list_add(l, a);
-				return l;
-			}
-		}
-		return NULL;
+		*arts = art_find_slot(root, uri);
+		return *arts != NULL ? 1 : -1;
 	}
 }
@@ -0,0 +1,325 @@
+#include "../include/cache.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+
+struct cache {
+	pthread_mutex_t lock;
+	cache_entry *buckets;
+	size_t       bucket_count;
+	size_t       count;
+	size_t       size;
+	size_t       max_size;
+	size_t       hits;
+	size_t       misses;
+	cache_entry  head;
+	cache_entry  tail;
+};
+
+
+/*
+ * Helpers
+ */
+static uint32_t hash(const string key)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < key->len; i++) {
+		h ^= (unsigned char)key->buf[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static size_t entry_size(cache_entry e)
+{
+	return sizeof(*e) + e->key->len + e->body->len;
+}
+
+
+static void lru_unlink(cache c, cache_entry e)
+{
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		c->head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		c->tail = e->prev;
+}
+
+
+static void lru_push(cache c, cache_entry e)
+{
+	e->prev = NULL;
+	e->next = c->head;
+	if (c->head != NULL)
+		c->head->prev = e;
+	else
+		c->tail = e;
+	c->head = e;
+}
+
+
+static void entry_free(cache_entry e)
+{
+	for (size_t i = 0; i < e->dep_count; i++)
+		free(e->deps[i].path);
+	free(e->deps);
+	free(e->key);
+	free(e->body);
+	free(e);
+}
+
+
+/*
+ * Unlinks an entry. The table itself holds one reference, so the entry is
+ * freed once no request is using it anymore.
+ */
+static void entry_remove(cache c, cache_entry e)
+{
+	cache_entry *p = &c->buckets[hash(e->key) & (c->bucket_count - 1)];
+	while (*p != e)
+		p = &(*p)->chain;
+	*p = e->chain;
+	lru_unlink(c, e);
+	c->count--;
+	c->size -= entry_size(e);
+	if (--e->refs == 0)
+		entry_free(e);
+}
+
+
+static cache_entry find(cache c, const string key)
+{
+	cache_entry e = c->buckets[hash(key) & (c->bucket_count - 1)];
+	while (e != NULL && !string_eq(e->key, key))
+		e = e->chain;
+	return e;
+}
+
+
+static int entry_is_fresh(cache_entry e)
+{
+	time_t now = time(NULL);
+	if (now - e->checked < CACHE_CHECK_INTERVAL)
+		return 1;
+	for (size_t i = 0; i < e->dep_count; i++) {
+		struct stat statbuf;
+		struct cache_dep *d = &e->deps[i];
+		if (stat(d->path->buf, &statbuf) < 0) {
+			if (d->size != -1)
+				return 0;
+		} else if (d->mtime != statbuf.st_mtime || d->size != statbuf.st_size ||
+		           d->ino != statbuf.st_ino) {
+			return 0;
+		}
+	}
+	e->checked = now;
+	return 1;
+}
+
+
+static int grow(cache c)
+{
+	size_t n = c->bucket_count * 2;
+	cache_entry *b = calloc(n, sizeof(*b));
+	if (b == NULL)
+		return -1;
+	for (size_t i = 0; i < c->bucket_count; i++) {
+		cache_entry e = c->buckets[i];
+		while (e != NULL) {
+			cache_entry next = e->chain;
+			size_t j = hash(e->key) & (n - 1);
+			e->chain = b[j];
+			b[j] = e;
+			e = next;
+		}
+	}
+	free(c->buckets);
+	c->buckets      = b;
+	c->bucket_count = n;
+	return 0;
+}
+
+
+/*
+ * Cache
+ */
+cache cache_create(size_t max_size)
+{
+	cache c = malloc(sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	c->bucket_count = 64;
+	c->buckets = calloc(c->bucket_count, sizeof(*c->buckets));
+	if (c->buckets == NULL) {
+		free(c);
+		return NULL;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	c->count    = 0;
+	c->size     = 0;
+	c->max_size = max_size;
+	c->hits     = 0;
+	c->misses   = 0;
+	c->head     = NULL;
+	c->tail     = NULL;
+	return c;
+}
+
+
+cache_entry cache_get(cache c, const string key)
+{
+	pthread_mutex_lock(&c->lock);
+	cache_entry e = find(c, key);
+	if (e != NULL) {
+		if (entry_is_fresh(e)) {
+			lru_unlink(c, e);
+			lru_push(c, e);
+			e->refs++;
+		} else {
+			entry_remove(c, e);
+			e = NULL;
+		}
+	}
+	// Counted under the lock that is taken anyway
+	if (e != NULL)
+		c->hits++;
+	else
+		c->misses++;
+	pthread_mutex_unlock(&c->lock);
+	return e;
+}
+
+
+cache_entry cache_put(cache c, const string key, const string *body, size_t parts,
+                      const string mime, int flags, const struct cache_dep *deps,
+                      size_t dep_count)
+{
+	size_t len = 0;
+	for (size_t i = 0; i < parts; i++)
+		len += body[i]->len;
+
+	// Don't let a single entry push out most of the cache
+	if (sizeof(struct cache_entry) + key->len + len > c->max_size / 8)
+		return NULL;
+
+	cache_entry e = calloc(1, sizeof(*e));
+	if (e == NULL)
+		return NULL;
+	e->key  = string_copy(key, 0, key->len);
+	e->body = malloc(sizeof(e->body->len) + len + 1);
+	if (e->body != NULL) {
+		e->body->len = 0;
+		for (size_t i = 0; i < parts; i++) {
+			memcpy(e->body->buf + e->body->len, body[i]->buf, body[i]->len);
+			e->body->len += body[i]->len;
+		}
+		e->body->buf[len] = 0;
+	}
+	e->deps = malloc(dep_count * sizeof(*e->deps));
+	if (e->key == NULL || e->body == NULL || (e->deps == NULL && dep_count > 0))
+		goto error;
+	for (size_t i = 0; i < dep_count; i++) {
+		e->deps[i] = deps[i];
+		e->deps[i].path = string_copy(deps[i].path, 0, deps[i].path->len);
+		if (e->deps[i].path == NULL)
+			goto error;
+		e->dep_count++;
+	}
+	// MIME types are static strings owned by the MIME table
+	e->mime    = mime;
+	e->flags   = flags;
+	e->checked = time(NULL);
+	e->refs    = 2;
+
+	pthread_mutex_lock(&c->lock);
+	cache_entry old = find(c, key);
+	if (old != NULL)
+		entry_remove(c, old);
+
+	// Make room
+	while (c->tail != NULL && c->size + entry_size(e) > c->max_size)
+		entry_remove(c, c->tail);
+	if (c->count >= c->bucket_count && grow(c) < 0) {
+		pthread_mutex_unlock(&c->lock);
+		goto error;
+	}
+
+	size_t i = hash(e->key) & (c->bucket_count - 1);
+	e->chain = c->buckets[i];
+	c->buckets[i] = e;
+	lru_push(c, e);
+	c->count++;
+	c->size += entry_size(e);
+	pthread_mutex_unlock(&c->lock);
+	return e;
+
+error:
+	entry_free(e);
+	return NULL;
+}
+
+
+void cache_release(cache c, cache_entry e)
+{
+	pthread_mutex_lock(&c->lock);
+	int refs = --e->refs;
+	pthread_mutex_unlock(&c->lock);
+	if (refs == 0)
+		entry_free(e);
+}
+
+
+void cache_del(cache c, const string key)
+{
+	pthread_mutex_lock(&c->lock);
+	cache_entry e = find(c, key);
+	if (e != NULL)
+		entry_remove(c, e);
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+void cache_dep_set(struct cache_dep *dep, const string path, const struct stat *statbuf)
+{
+	dep->path = path;
+	if (statbuf != NULL) {
+		dep->mtime = statbuf->st_mtime;
+		dep->size  = statbuf->st_size;
+		dep->ino   = statbuf->st_ino;
+	} else {
+		dep->mtime = 0;
+		dep->size  = -1;
+		dep->ino   = 0;
+	}
+}
+
+
+void cache_stats(cache c, struct cache_stats *stats)
+{
+	pthread_mutex_lock(&c->lock);
+	stats->hits     = c->hits;
+	stats->misses   = c->misses;
+	stats->count    = c->count;
+	stats->size     = c->size;
+	stats->max_size = c->max_size;
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+void cache_free(cache c)
+{
+	while (c->head != NULL)
+		entry_remove(c, c->head);
+	pthread_mutex_destroy(&c->lock);
+	free(c->buckets);
+	free(c);
+}
@@ -0,0 +1,809 @@
+#define _GNU_SOURCE
+#include "../include/fcgi.h"
+#include "../include/poller.h"
+#include <errno.h>
+#include <fastcgi.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+// The content of a record is kept a multiple of 8 so no padding is needed
+#define RECORD_MAX   (FCGI_HEADER_LEN + 0xfff8)
+#define READ_MAX     (FCGI_HEADER_LEN + 0xffff + 0xff)
+#define MAX_QUEUED   (1 << 18)
+#define MAX_PARAMS   (1 << 16)
+#define MAX_STDIN    (1 << 20)
+#define MAX_REQS     "1000"
+#define MAX_CONNS    "1000"
+
+
+struct chunk {
+	struct chunk *next;
+	// Set if the data isn't part of the chunk itself
+	struct fcgi_request *owner;
+	const char *data;
+	size_t len;
+	size_t sent;
+	char buf[];
+};
+
+struct conn {
+	int fd;
+	// The event loop and each request hold a reference
+	int refs;
+	int closed;
+	int close_when_done;
+	int want_write;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	struct chunk *out_head;
+	struct chunk *out_tail;
+	size_t queued;
+	struct fcgi_request **reqs;
+	size_t req_cap;
+	// Only used by the event loop
+	char  *in;
+	size_t in_len;
+	size_t in_cap;
+	struct fcgi_server *server;
+};
+
+struct fcgi_request {
+	struct conn *conn;
+	uint16_t id;
+	int keep_conn;
+	int aborted;
+	int dispatched;
+	char **params;
+	char  *param_buf;
+	size_t param_len;
+	char  *in;
+	size_t in_len;
+	size_t in_pos;
+	// The record that is being filled
+	struct chunk *cur;
+	size_t ext_pending;
+	struct fcgi_request *next;
+};
+
+struct fcgi_server {
+	int listen_fd;
+	poller poller;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	struct fcgi_request *ready_head;
+	struct fcgi_request *ready_tail;
+};
+
+
+/*
+ * Records
+ */
+static void put_header(char *h, int type, int id, size_t len)
+{
+	h[0] = FCGI_VERSION_1;
+	h[1] = type;
+	h[2] = id  >> 8;
+	h[3] = id;
+	h[4] = len >> 8;
+	h[5] = len;
+	h[6] = 0;
+	h[7] = 0;
+}
+
+
+static struct chunk *chunk_create(size_t size)
+{
+	struct chunk *ch = malloc(sizeof(*ch) + size);
+	if (ch == NULL)
+		return NULL;
+	ch->next  = NULL;
+	ch->owner = NULL;
+	ch->data  = ch->buf;
+	ch->len   = 0;
+	ch->sent  = 0;
+	return ch;
+}
+
+
+static void chunk_free(struct chunk *ch)
+{
+	if (ch->owner != NULL)
+		ch->owner->ext_pending--;
+	free(ch);
+}
+
+
+/*
+ * Connections
+ *
+ * Unless noted otherwise, these must be called with the lock of the connection
+ * held.
+ */
+static void queue(struct conn *c, struct chunk *ch)
+{
+	if (c->closed) {
+		chunk_free(ch);
+		return;
+	}
+	if (c->out_tail != NULL)
+		c->out_tail->next = ch;
+	else
+		c->out_head = ch;
+	c->out_tail = ch;
+	c->queued  += ch->len;
+}
+
+
+static void drop_output(struct conn *c)
+{
+	while (c->out_head != NULL) {
+		struct chunk *ch = c->out_head;
+		c->out_head = ch->next;
+		chunk_free(ch);
+	}
+	c->out_tail = NULL;
+	c->queued   = 0;
+	pthread_cond_broadcast(&c->cond);
+}
+
+
+/*
+ * Writes as much of the queued output as the socket accepts.
+ */
+static void flush_conn(struct conn *c)
+{
+	int progress = 0;
+	while (c->out_head != NULL && !c->closed) {
+		struct iovec iov[64];
+		struct msghdr msg = { .msg_iov = iov };
+		for (struct chunk *ch = c->out_head; ch != NULL && msg.msg_iovlen < 64; ch = ch->next) {
+			iov[msg.msg_iovlen].iov_base = (char *)ch->data + ch->sent;
+			iov[msg.msg_iovlen].iov_len  = ch->len - ch->sent;
+			msg.msg_iovlen++;
+		}
+		ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				// The event loop will notice the socket is broken
+				c->closed = 1;
+				drop_output(c);
+			}
+			break;
+		}
+		progress = 1;
+		c->queued -= n;
+		while (n > 0) {
+			struct chunk *ch = c->out_head;
+			size_t k = ch->len - ch->sent < (size_t)n ? ch->len - ch->sent : (size_t)n;
+			ch->sent += k;
+			n        -= k;
+			if (ch->sent == ch->len) {
+				c->out_head = ch->next;
+				if (c->out_head == NULL)
+					c->out_tail = NULL;
+				chunk_free(ch);
+			}
+		}
+	}
+	if (c->out_head == NULL && c->close_when_done)
+		shutdown(c->fd, SHUT_RDWR);
+	if (progress)
+		pthread_cond_broadcast(&c->cond);
+
+	// The event loop finishes what the socket didn't take
+	int want = c->out_head != NULL && !c->closed;
+	if (want != c->want_write) {
+		c->want_write = want;
+		poller_want_write(c->server->poller, c->fd, want);
+	}
+}
+
+
+static void end_request(struct conn *c, int id, int status)
+{
+	struct chunk *ch = chunk_create(FCGI_HEADER_LEN + sizeof(FCGI_EndRequestBody));
+	if (ch == NULL)
+		return;
+	put_header(ch->buf, FCGI_END_REQUEST, id, sizeof(FCGI_EndRequestBody));
+	FCGI_EndRequestBody *b = (FCGI_EndRequestBody *)(ch->buf + FCGI_HEADER_LEN);
+	memset(b, 0, sizeof(*b));
+	b->protocolStatus = status;
+	ch->len = FCGI_HEADER_LEN + sizeof(*b);
+	queue(c, ch);
+}
+
+
+static void conn_destroy(struct conn *c)
+{
+	close(c->fd);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	free(c->reqs);
+	free(c->in);
+	free(c);
+}
+
+
+static void request_free(struct fcgi_request *r)
+{
+	free(r->params);
+	free(r->param_buf);
+	free(r->in);
+	free(r->cur);
+	free(r);
+}
+
+
+/*
+ * Removes a request that wasn't handed to a thread yet.
+ */
+static void request_drop(struct conn *c, struct fcgi_request *r)
+{
+	c->reqs[r->id] = NULL;
+	c->refs--;
+	request_free(r);
+}
+
+
+/*
+ * Closes a connection from the event loop. Requests that are still being
+ * handled keep the connection alive, but their output is discarded. Must be
+ * called without the lock held.
+ */
+static void conn_close(struct conn *c)
+{
+	poller_del(c->server->poller, c->fd);
+	pthread_mutex_lock(&c->lock);
+	c->closed = 1;
+	drop_output(c);
+	for (size_t i = 0; i < c->req_cap; i++) {
+		if (c->reqs[i] != NULL && !c->reqs[i]->dispatched)
+			request_drop(c, c->reqs[i]);
+	}
+	int refs = --c->refs;
+	pthread_mutex_unlock(&c->lock);
+	if (refs == 0)
+		conn_destroy(c);
+}
+
+
+/*
+ * Requests
+ */
+
+/*
+ * Converts the name-value pairs into "NAME=VALUE" strings. These never take
+ * more room than the pairs themselves as each length takes at least one byte.
+ */
+static int parse_params(struct fcgi_request *r)
+{
+	const unsigned char *p = (unsigned char *)r->param_buf, *end = p + r->param_len;
+	char  *strs   = malloc(r->param_len + 1);
+	size_t count  = 0, cap = 16;
+	char **params = malloc(cap * sizeof(*params));
+	char  *s      = strs;
+	if (strs == NULL || params == NULL)
+		goto error;
+	while (p < end) {
+		size_t len[2];
+		for (int i = 0; i < 2; i++) {
+			if (p >= end)
+				goto error;
+			if (*p >> 7) {
+				if (end - p < 4)
+					goto error;
+				len[i] = ((size_t)(p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+				p += 4;
+			} else {
+				len[i] = *p++;
+			}
+		}
+		if ((size_t)(end - p) < len[0] + len[1])
+			goto error;
+		if (count + 2 > cap) {
+			cap *= 2;
+			char **n = realloc(params, cap * sizeof(*params));
+			if (n == NULL)
+				goto error;
+			params = n;
+		}
+		params[count++] = s;
+		memcpy(s, p, len[0]);
+		s += len[0];
+		*s++ = '=';
+		memcpy(s, p + len[0], len[1]);
+		s += len[1];
+		*s++ = 0;
+		p += len[0] + len[1];
+	}
+	params[count] = NULL;
+	free(r->param_buf);
+	r->param_buf = strs;
+	r->params    = params;
+	return 0;
+
+error:
+	free(strs);
+	free(params);
+	return -1;
+}
+
+
+static int append(char **buf, size_t *len, const char *data, size_t n, size_t max)
+{
+	if (*len + n > max)
+		return -1;
+	char *b = realloc(*buf, *len + n);
+	if (b == NULL)
+		return -1;
+	memcpy(b + *len, data, n);
+	*buf  = b;
+	*len += n;
+	return 0;
+}
+
+
+/*
+ * Ends a request that can't be handled with a response of its own.
+ */
+static void reject(struct conn *c, struct fcgi_request *r, const char *response)
+{
+	size_t len = strlen(response);
+	struct chunk *ch = chunk_create(FCGI_HEADER_LEN * 2 + len);
+	if (ch != NULL) {
+		put_header(ch->buf, FCGI_STDOUT, r->id, len);
+		memcpy(ch->buf + FCGI_HEADER_LEN, response, len);
+		put_header(ch->buf + FCGI_HEADER_LEN + len, FCGI_STDOUT, r->id, 0);
+		ch->len = FCGI_HEADER_LEN * 2 + len;
+		queue(c, ch);
+	}
+	end_request(c, r->id, FCGI_REQUEST_COMPLETE);
+	if (!r->keep_conn)
+		c->close_when_done = 1;
+	request_drop(c, r);
+}
+
+
+static void dispatch(struct fcgi_request *r)
+{
+	struct fcgi_server *s = r->conn->server;
+	r->dispatched = 1;
+	pthread_mutex_lock(&s->lock);
+	if (s->ready_tail != NULL)
+		s->ready_tail->next = r;
+	else
+		s->ready_head = r;
+	s->ready_tail = r;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+
+static void get_values(struct conn *c, const unsigned char *p, size_t len)
+{
+	static const char *values[][2] = {
+		{ FCGI_MAX_CONNS , MAX_CONNS },
+		{ FCGI_MAX_REQS  , MAX_REQS  },
+		{ FCGI_MPXS_CONNS, "1"       },
+	};
+	struct chunk *ch = chunk_create(FCGI_HEADER_LEN + 256);
+	if (ch == NULL)
+		return;
+	ch->len = FCGI_HEADER_LEN;
+	const unsigned char *end = p + len;
+	// Only names shorter than 128 bytes and empty values are expected
+	while (end - p >= 2) {
+		size_t n = p[0], v = p[1];
+		p += 2;
+		if (n >= 128 || v >= 128 || (size_t)(end - p) < n + v)
+			break;
+		for (size_t i = 0; i < sizeof(values) / sizeof(*values); i++) {
+			size_t vn = strlen(values[i][0]), vv = strlen(values[i][1]);
+			if (vn != n || memcmp(values[i][0], p, n) != 0 || ch->len + 2 + vn + vv > FCGI_HEADER_LEN + 256)
+				continue;
+			ch->buf[ch->len++] = vn;
+			ch->buf[ch->len++] = vv;
+			memcpy(ch->buf + ch->len, values[i][0], vn);
+			ch->len += vn;
+			memcpy(ch->buf + ch->len, values[i][1], vv);
+			ch->len += vv;
+		}
+		p += n + v;
+	}
+	put_header(ch->buf, FCGI_GET_VALUES_RESULT, FCGI_NULL_REQUEST_ID, ch->len - FCGI_HEADER_LEN);
+	queue(c, ch);
+}
+
+
+static void process_record(struct conn *c, int type, int id, const unsigned char *content, size_t len)
+{
+	struct fcgi_request *r = (size_t)id < c->req_cap ? c->reqs[id] : NULL;
+
+	switch (type) {
+	case FCGI_BEGIN_REQUEST:
+		if (r != NULL || id == FCGI_NULL_REQUEST_ID || len < sizeof(FCGI_BeginRequestBody))
+			break;
+		if (((content[0] << 8) | content[1]) != FCGI_RESPONDER) {
+			end_request(c, id, FCGI_UNKNOWN_ROLE);
+			break;
+		}
+		if ((size_t)id >= c->req_cap) {
+			size_t cap = c->req_cap > 0 ? c->req_cap : 16;
+			while (cap <= (size_t)id)
+				cap *= 2;
+			struct fcgi_request **reqs = realloc(c->reqs, cap * sizeof(*reqs));
+			if (reqs == NULL) {
+				end_request(c, id, FCGI_OVERLOADED);
+				break;
+			}
+			memset(reqs + c->req_cap, 0, (cap - c->req_cap) * sizeof(*reqs));
+			c->reqs    = reqs;
+			c->req_cap = cap;
+		}
+		r = calloc(1, sizeof(*r));
+		if (r == NULL) {
+			end_request(c, id, FCGI_OVERLOADED);
+			break;
+		}
+		r->conn      = c;
+		r->id        = id;
+		r->keep_conn = content[2] & FCGI_KEEP_CONN;
+		c->reqs[id]  = r;
+		c->refs++;
+		break;
+
+	case FCGI_ABORT_REQUEST:
+		if (r == NULL)
+			break;
+		if (r->dispatched) {
+			// The thread handling it will end it
+			r->aborted = 1;
+		} else {
+			end_request(c, id, FCGI_REQUEST_COMPLETE);
+			request_drop(c, r);
+		}
+		break;
+
+	case FCGI_PARAMS:
+		if (r == NULL || r->params != NULL)
+			break;
+		if (len == 0) {
+			if (parse_params(r) < 0)
+				reject(c, r, "Status: 400\r\n\r\n");
+		} else if (append(&r->param_buf, &r->param_len, (char *)content, len, MAX_PARAMS) < 0) {
+			reject(c, r, "Status: 431\r\n\r\n");
+		}
+		break;
+
+	case FCGI_STDIN:
+		if (r == NULL || r->params == NULL || r->dispatched)
+			break;
+		if (len == 0)
+			dispatch(r);
+		else if (append(&r->in, &r->in_len, (char *)content, len, MAX_STDIN) < 0)
+			reject(c, r, "Status: 413\r\n\r\n");
+		break;
+
+	case FCGI_GET_VALUES:
+		if (id == FCGI_NULL_REQUEST_ID)
+			get_values(c, content, len);
+		break;
+
+	default:
+		// Management records have to be answered, others are ignored
+		if (id == FCGI_NULL_REQUEST_ID) {
+			struct chunk *ch = chunk_create(FCGI_HEADER_LEN + sizeof(FCGI_UnknownTypeBody));
+			if (ch == NULL)
+				break;
+			put_header(ch->buf, FCGI_UNKNOWN_TYPE, 0, sizeof(FCGI_UnknownTypeBody));
+			memset(ch->buf + FCGI_HEADER_LEN, 0, sizeof(FCGI_UnknownTypeBody));
+			ch->buf[FCGI_HEADER_LEN] = type;
+			ch->len = FCGI_HEADER_LEN + sizeof(FCGI_UnknownTypeBody);
+			queue(c, ch);
+		}
+		break;
+	}
+}
+
+
+/*
+ * Reads and processes all available records. Must be called without the lock
+ * held.
+ *
+ * Returns: -1 if the connection should be closed.
+ */
+static int read_conn(struct conn *c)
+{
+	while (1) {
+		if (c->in_cap - c->in_len < 4096 && c->in_cap < READ_MAX) {
+			size_t cap = c->in_cap > 0 ? c->in_cap * 2 : 8192;
+			char *in = realloc(c->in, cap < READ_MAX ? cap : READ_MAX);
+			if (in == NULL)
+				return -1;
+			c->in     = in;
+			c->in_cap = cap < READ_MAX ? cap : READ_MAX;
+		}
+		ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n <= 0)
+			return -1;
+		c->in_len += n;
+
+		size_t pos = 0;
+		int ret = 0;
+		pthread_mutex_lock(&c->lock);
+		while (c->in_len - pos >= FCGI_HEADER_LEN) {
+			const unsigned char *h = (unsigned char *)c->in + pos;
+			size_t len   = (h[4] << 8) | h[5];
+			size_t total = FCGI_HEADER_LEN + len + h[6];
+			if (h[0] != FCGI_VERSION_1) {
+				ret = -1;
+				break;
+			}
+			if (c->in_len - pos < total)
+				break;
+			process_record(c, h[1], (h[2] << 8) | h[3], h + FCGI_HEADER_LEN, len);
+			pos += total;
+		}
+		flush_conn(c);
+		pthread_mutex_unlock(&c->lock);
+		if (ret < 0)
+			return -1;
+		memmove(c->in, c->in + pos, c->in_len - pos);
+		c->in_len -= pos;
+	}
+}
+
+
+static void accept_conns(struct fcgi_server *s)
+{
+	while (1) {
+		int fd = poller_accept(s->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("Failed to accept connection");
+			return;
+		}
+		struct conn *c = calloc(1, sizeof(*c));
+		if (c == NULL) {
+			close(fd);
+			continue;
+		}
+		c->fd     = fd;
+		c->refs   = 1;
+		c->server = s;
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_cond_init(&c->cond, NULL);
+		if (poller_add(s->poller, fd, c, POLLER_IN | POLLER_OUT) < 0) {
+			perror("Failed to add connection");
+			conn_destroy(c);
+		}
+	}
+}
+
+
+/*
+ * Server
+ */
+fcgi_server fcgi_create(int listen_fd)
+{
+	struct fcgi_server *s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	s->listen_fd = listen_fd;
+	s->poller    = poller_create();
+	if (s->poller == NULL) {
+		free(s);
+		return NULL;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	// The socket may be shared with other processes
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+	if (poller_add_listener(s->poller, listen_fd) < 0) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+
+void *fcgi_run(void *server)
+{
+	struct fcgi_server *s = server;
+	struct poller_event events[64];
+	while (1) {
+		int n = poller_wait(s->poller, events, 64, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Failed to wait for events");
+			return NULL;
+		}
+		for (int i = 0; i < n; i++) {
+			struct conn *c = events[i].ptr;
+			if (c == NULL) {
+				accept_conns(s);
+			} else {
+				if (events[i].events & POLLER_OUT) {
+					pthread_mutex_lock(&c->lock);
+					flush_conn(c);
+					pthread_mutex_unlock(&c->lock);
+				}
+				if (events[i].events & (POLLER_IN | POLLER_HUP)) {
+					if (read_conn(c) < 0)
+						conn_close(c);
+				}
+			}
+		}
+	}
+}
+
+
+fcgi_request fcgi_accept(fcgi_server s)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->ready_head == NULL)
+		pthread_cond_wait(&s->cond, &s->lock);
+	struct fcgi_request *r = s->ready_head;
+	s->ready_head = r->next;
+	if (s->ready_head == NULL)
+		s->ready_tail = NULL;
+	pthread_mutex_unlock(&s->lock);
+	r->next = NULL;
+	return r;
+}
+
+
+const char *fcgi_getparam(fcgi_request r, const char *name)
+{
+	size_t n = strlen(name);
+	for (char **p = r->params; *p != NULL; p++) {
+		if (strncmp(*p, name, n) == 0 && (*p)[n] == '=')
+			return *p + n + 1;
+	}
+	return NULL;
+}
+
+
+size_t fcgi_read(fcgi_request r, char *buf, size_t n)
+{
+	if (n > r->in_len - r->in_pos)
+		n = r->in_len - r->in_pos;
+	memcpy(buf, r->in + r->in_pos, n);
+	r->in_pos += n;
+	return n;
+}
+
+
+/*
+ * Queues the record that is being filled. Must be called with the lock of the
+ * connection held.
+ */
+static void queue_record(struct fcgi_request *r)
+{
+	struct chunk *ch = r->cur;
+	if (ch == NULL)
+		return;
+	r->cur = NULL;
+	if (ch->len == FCGI_HEADER_LEN || r->aborted) {
+		free(ch);
+		return;
+	}
+	put_header(ch->buf, FCGI_STDOUT, r->id, ch->len - FCGI_HEADER_LEN);
+	queue(r->conn, ch);
+}
+
+
+void fcgi_write(fcgi_request r, const char *buf, size_t n)
+{
+	struct conn *c = r->conn;
+
+	if (n >= FCGI_COPY_MAX) {
+		// Send the data from where it is. Only the headers are allocated.
+		pthread_mutex_lock(&c->lock);
+		queue_record(r);
+		while (n > 0 && !c->closed && !r->aborted) {
+			size_t k = n < 0xffff ? n : 0xffff;
+			struct chunk *h = chunk_create(FCGI_HEADER_LEN);
+			struct chunk *d = chunk_create(0);
+			if (h == NULL || d == NULL) {
+				free(h);
+				free(d);
+				break;
+			}
+			put_header(h->buf, FCGI_STDOUT, r->id, k);
+			h->len   = FCGI_HEADER_LEN;
+			d->data  = buf;
+			d->len   = k;
+			d->owner = r;
+			r->ext_pending++;
+			queue(c, h);
+			queue(c, d);
+			buf += k;
+			n   -= k;
+		}
+		flush_conn(c);
+		while (c->queued > MAX_QUEUED && !c->closed)
+			pthread_cond_wait(&c->cond, &c->lock);
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+
+	while (n > 0) {
+		if (r->cur == NULL) {
+			r->cur = chunk_create(RECORD_MAX);
+			if (r->cur == NULL)
+				return;
+			r->cur->len = FCGI_HEADER_LEN;
+		}
+		size_t k = RECORD_MAX - r->cur->len;
+		k = n < k ? n : k;
+		memcpy(r->cur->buf + r->cur->len, buf, k);
+		r->cur->len += k;
+		buf += k;
+		n   -= k;
+		if (r->cur->len == RECORD_MAX) {
+			pthread_mutex_lock(&c->lock);
+			queue_record(r);
+			flush_conn(c);
+			while (c->queued > MAX_QUEUED && !c->closed)
+				pthread_cond_wait(&c->cond, &c->lock);
+			pthread_mutex_unlock(&c->lock);
+		}
+	}
+}
+
+
+void fcgi_flush(fcgi_request r)
+{
+	struct conn *c = r->conn;
+	pthread_mutex_lock(&c->lock);
+	queue_record(r);
+	flush_conn(c);
+	while (r->ext_pending > 0 && !c->closed)
+		pthread_cond_wait(&c->cond, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+void fcgi_finish(fcgi_request r)
+{
+	struct conn *c = r->conn;
+	pthread_mutex_lock(&c->lock);
+	queue_record(r);
+	struct chunk *ch = chunk_create(FCGI_HEADER_LEN);
+	if (ch != NULL) {
+		put_header(ch->buf, FCGI_STDOUT, r->id, 0);
+		ch->len = FCGI_HEADER_LEN;
+		queue(c, ch);
+	}
+	end_request(c, r->id, FCGI_REQUEST_COMPLETE);
+	if (!r->keep_conn)
+		c->close_when_done = 1;
+	c->reqs[r->id] = NULL;
+	flush_conn(c);
+	while (r->ext_pending > 0 && !c->closed)
+		pthread_cond_wait(&c->cond, &c->lock);
+	int refs = --c->refs;
+	pthread_mutex_unlock(&c->lock);
+	request_free(r);
+	if (refs == 0)
+		conn_destroy(c);
+}
@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include "../include/fileio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "temp-alloc.h"
+#ifdef __NR_io_uring_setup
+# include <linux/io_uring.h>
+#endif
+
+
+/*
+ * Reads an opened file and closes it. The size is taken from the file itself,
+ * so it matches what is read even if the path is replaced meanwhile.
+ */
+static string read_opened(int fd, struct stat *statbuf)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	string str = temp_alloc(sizeof(str->len) + st.st_size + 1);
+	if (str == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	ssize_t n = file_read_close(fd, str->buf, st.st_size);
+	if (n < 0)
+		return NULL;
+	str->buf[n] = 0;
+	str->len = n;
+	if (statbuf != NULL)
+		*statbuf = st;
+	return str;
+}
+
+
+/*
+ * Fallback
+ */
+static string read_plain(const char *path, struct stat *statbuf)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	return read_opened(fd, statbuf);
+}
+
+
+/*
+ * Reads the rest of a file of which total bytes have been read already.
+ */
+static ssize_t read_close_plain(int fd, char *buf, size_t n, size_t total)
+{
+	while (total < n) {
+		ssize_t k = pread(fd, buf + total, n - total, total);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k < 0) {
+			int err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+		if (k == 0)
+			break;
+		total += k;
+	}
+	close(fd);
+	return total;
+}
+
+
+#ifdef __NR_io_uring_setup
+
+/*
+ * io_uring
+ *
+ * The ring is always empty between calls: the entries of one step are
+ * submitted and waited for with a single io_uring_enter.
+ */
+#define RING_ENTRIES 8
+
+static __thread struct ring {
+	// 0 if not set up yet, -1 if io_uring can't be used
+	int fd;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+} ring;
+
+
+static int ring_setup()
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (fd < 0)
+		goto error;
+
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_len = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+	char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto error_fd;
+	char *cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		          fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto error_fd;
+	}
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto error_fd;
+
+	ring.sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.cq_head  = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring.fd       = fd;
+	return 0;
+
+	// Mappings made before a failure are left in place. This happens at most
+	// once per thread.
+error_fd:
+	close(fd);
+error:
+	ring.fd = -1;
+	return -1;
+}
+
+
+static int ring_usable()
+{
+	return ring.fd > 0 || (ring.fd == 0 && ring_setup() == 0);
+}
+
+
+static struct io_uring_sqe *ring_sqe(int op, int fd, uint64_t data)
+{
+	unsigned tail = *ring.sq_tail, i = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = op;
+	sqe->fd        = fd;
+	sqe->user_data = data;
+	ring.sq_array[i] = i;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+
+/*
+ * Submits the queued entries and waits for all of them. The results are
+ * stored by user_data.
+ */
+static int ring_submit(int count, int *res)
+{
+	int done = 0;
+	while (done < count) {
+		int n = syscall(__NR_io_uring_enter, ring.fd, done == 0 ? count : 0,
+		                count - done, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0 && errno != EINTR)
+			return -1;
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			res[cqe->user_data] = cqe->res;
+			done++;
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+
+/*
+ * Stops using io_uring on this thread if an operation isn't supported.
+ */
+static int unsupported(int res)
+{
+	if (res == -EINVAL || res == -EOPNOTSUPP) {
+		close(ring.fd);
+		ring.fd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+
+string file_read(const char *path, struct stat *statbuf)
+{
+	if (!ring_usable())
+		return read_plain(path, statbuf);
+
+	int res[1];
+	struct io_uring_sqe *sqe = ring_sqe(IORING_OP_OPENAT, AT_FDCWD, 0);
+	sqe->addr       = (uintptr_t)path;
+	sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	if (ring_submit(1, res) < 0 || unsupported(res[0]))
+		return read_plain(path, statbuf);
+	if (res[0] < 0) {
+		errno = -res[0];
+		return NULL;
+	}
+	return read_opened(res[0], statbuf);
+}
+
+
+ssize_t file_read_close(int fd, char *buf, size_t n)
+{
+	if (!ring_usable())
+		return read_close_plain(fd, buf, n, 0);
+
+	// A short or failed read cancels the close, so the rest can still be read
+	int res[2];
+	struct io_uring_sqe *sqe = ring_sqe(IORING_OP_READ, fd, 0);
+	sqe->addr  = (uintptr_t)buf;
+	sqe->len   = n;
+	sqe->off   = 0;
+	sqe->flags = IOSQE_IO_LINK;
+	ring_sqe(IORING_OP_CLOSE, fd, 1);
+	if (ring_submit(2, res) < 0)
+		return read_close_plain(fd, buf, n, 0);
+	if (unsupported(res[0]) || unsupported(res[1])) {
+		if (res[1] < 0)
+			return read_close_plain(fd, buf, n, 0);
+		// The file was closed, but not read
+		errno = EIO;
+		return -1;
+	}
+	if (res[0] < 0) {
+		if (res[1] < 0)
+			close(fd);
+		errno = -res[0];
+		return -1;
+	}
+	if (res[1] == -ECANCELED)
+		return read_close_plain(fd, buf, n, res[0]);
+	if (res[1] < 0)
+		close(fd);
+	return res[0];
+}
+
+#else
+
+string file_read(const char *path, struct stat *statbuf)
+{
+	return read_plain(path, statbuf);
+}
+
+
+ssize_t file_read_close(int fd, char *buf, size_t n)
+{
+	return read_close_plain(fd, buf, n, 0);
+}
+
+#endif
@@ -0,0 +1,961 @@
+#define _GNU_SOURCE
+#include "../include/http.h"
+#include "../include/poller.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <sys/sendfile.h>
+#endif
+
+
+#define MAX_HEADER    (1 << 14)
+#define MAX_BODY      (1 << 20)
+#define MAX_BUFFER    (MAX_HEADER + 2 * MAX_BODY)
+#define WRITE_TIMEOUT 30000
+// How long a connection may take to send a complete request
+#define READ_TIMEOUT  30000
+
+
+struct buf {
+	char  *buf;
+	size_t len;
+	size_t cap;
+};
+
+struct conn {
+	int fd;
+	// The event loop and the request being handled hold a reference
+	int refs;
+	int busy;
+	int eof;
+	int closing;
+	int broken;
+	int continued;
+	pthread_mutex_t lock;
+	char  *in;
+	size_t in_len;
+	size_t in_cap;
+	// How far the chunked body of the next request has been decoded
+	struct buf body;
+	size_t chunk_pos;
+	int    trailers;
+	// When the next request has to be read by, unless one is being handled
+	int64_t deadline;
+	char   addr[INET6_ADDRSTRLEN];
+	struct http_server *server;
+	// Only used by the event loop
+	struct conn *prev;
+	struct conn *next;
+};
+
+struct http_request {
+	struct conn *conn;
+	char **params;
+	char  *param_buf;
+	char  *body;
+	size_t body_len;
+	size_t body_pos;
+	int head;
+	int keep_alive;
+	int http10;
+	// The CGI headers written so far, until the end of them is seen
+	char  *hdr;
+	size_t hdr_len;
+	int hdr_done;
+	int chunked;
+	int no_body;
+	struct http_request *next;
+};
+
+struct http_server {
+	int listen_fd;
+	poller poller;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	struct http_request *ready_head;
+	struct http_request *ready_tail;
+	// The connections the event loop reads from
+	struct conn *conns;
+};
+
+
+/*
+ * Helpers
+ */
+static int buf_add(struct buf *b, const char *s, size_t n)
+{
+	if (b->len + n + 1 > b->cap) {
+		size_t cap = b->cap > 0 ? b->cap : 256;
+		while (b->len + n + 1 > cap)
+			cap *= 2;
+		char *p = realloc(b->buf, cap);
+		if (p == NULL)
+			return -1;
+		b->buf = p;
+		b->cap = cap;
+	}
+	memcpy(b->buf + b->len, s, n);
+	b->len += n;
+	b->buf[b->len] = 0;
+	return 0;
+}
+
+
+static int64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ll + ts.tv_nsec / 1000000;
+}
+
+
+static const char *reason(int status)
+{
+	switch (status) {
+	case 100: return "Continue";
+	case 200: return "OK";
+	case 206: return "Partial Content";
+	case 301: return "Moved Permanently";
+	case 302: return "Found";
+	case 303: return "See Other";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 413: return "Payload Too Large";
+	case 416: return "Range Not Satisfiable";
+	case 431: return "Request Header Fields Too Large";
+	case 500: return "Internal Server Error";
+	case 501: return "Not Implemented";
+	default:  return "";
+	}
+}
+
+
+/*
+ * Sends all data, waiting if the socket is full.
+ */
+static void send_all(struct conn *c, struct iovec *iov, int count, int more)
+{
+	while (count > 0 && !c->broken) {
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+		ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			struct pollfd p = { .fd = c->fd, .events = POLLOUT };
+			if ((errno != EAGAIN && errno != EWOULDBLOCK) || poll(&p, 1, WRITE_TIMEOUT) <= 0)
+				c->broken = 1;
+			continue;
+		}
+		while (count > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+
+/*
+ * Percent-decodes a path in place. Returns -1 if the path may escape the
+ * current directory.
+ */
+static int decode_path(char *path)
+{
+	char *w = path;
+	for (char *r = path; *r != 0; r++) {
+		if (*r == '%' && isxdigit(r[1]) && isxdigit(r[2])) {
+			char hex[3] = { r[1], r[2], 0 };
+			*w = strtol(hex, NULL, 16);
+			r += 2;
+			if (*w == 0)
+				return -1;
+			w++;
+		} else {
+			*w++ = *r;
+		}
+	}
+	*w = 0;
+	// Reject any ".." segment
+	for (char *p = path; (p = strstr(p, "..")) != NULL; p += 2) {
+		if ((p == path || p[-1] == '/') && (p[2] == '/' || p[2] == 0))
+			return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Decodes a chunked body into the body of the connection. What was decoded
+ * is remembered, so a body that arrives in many reads is only decoded once.
+ *
+ * Returns: the amount of bytes the body took, 0 if it is incomplete or -1 if
+ * it is malformed or too large.
+ */
+static ssize_t decode_chunked(struct conn *c, const char *start, size_t len)
+{
+	const char *p = start + c->chunk_pos, *end = start + len;
+	while (!c->trailers) {
+		const char *eol = memmem(p, end - p, "\r\n", 2);
+		if (eol == NULL)
+			return 0;
+		char *e;
+		size_t size = strtoul(p, &e, 16);
+		if (e == p)
+			return -1;
+		if (size == 0) {
+			p = eol + 2;
+			c->trailers = 1;
+			break;
+		}
+		if (size > MAX_BODY || c->body.len + size > MAX_BODY)
+			return -1;
+		if ((size_t)(end - eol - 2) < size + 2)
+			return 0;
+		if (buf_add(&c->body, eol + 2, size) < 0)
+			return -1;
+		p = eol + 2 + size + 2;
+		c->chunk_pos = p - start;
+	}
+	// Skip the trailers, which end with an empty line
+	while (1) {
+		const char *eol = memmem(p, end - p, "\r\n", 2);
+		if (eol == NULL)
+			return 0;
+		int empty = eol == p;
+		p = eol + 2;
+		c->chunk_pos = p - start;
+		if (empty)
+			return p - start;
+	}
+}
+
+
+static void reset_body(struct conn *c)
+{
+	free(c->body.buf);
+	c->body      = (struct buf){ 0 };
+	c->chunk_pos = 0;
+	c->trailers  = 0;
+}
+
+
+/*
+ * Connections
+ */
+static void conn_unref(struct conn *c)
+{
+	pthread_mutex_lock(&c->lock);
+	int refs = --c->refs;
+	pthread_mutex_unlock(&c->lock);
+	if (refs > 0)
+		return;
+	close(c->fd);
+	pthread_mutex_destroy(&c->lock);
+	free(c->in);
+	free(c->body.buf);
+	free(c);
+}
+
+
+static void request_free(struct http_request *r)
+{
+	free(r->params);
+	free(r->param_buf);
+	free(r->body);
+	free(r->hdr);
+	free(r);
+}
+
+
+/*
+ * Sends a response of its own for a request that can't be handled and closes
+ * the connection.
+ */
+static void reject(struct conn *c, int status)
+{
+	char buf[128];
+	int n = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n"
+	                 "Connection: close\r\n\r\n", status, reason(status));
+	send(c->fd, buf, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+	shutdown(c->fd, SHUT_RDWR);
+	c->closing = 1;
+}
+
+
+static int add_param(struct buf *b, size_t **offsets, size_t *count,
+                     const char *name, size_t nlen, const char *value, size_t vlen)
+{
+	size_t *o = realloc(*offsets, (*count + 1) * sizeof(*o));
+	if (o == NULL)
+		return -1;
+	*offsets = o;
+	o[(*count)++] = b->len;
+	if (buf_add(b, name, nlen) < 0 || buf_add(b, "=", 1) < 0 ||
+	    buf_add(b, value, vlen) < 0 || buf_add(b, "", 1) < 0)
+		return -1;
+	return 0;
+}
+
+
+/*
+ * Parses the request at the start of the input buffer.
+ *
+ * Returns: the request, NULL if it is incomplete. *status is set if the request
+ * is invalid.
+ */
+static struct http_request *parse_request(struct conn *c, int *status)
+{
+	*status = 0;
+	char *end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+	if (end == NULL) {
+		if (c->in_len > MAX_HEADER)
+			*status = 431;
+		return NULL;
+	}
+	size_t header_len = end + 4 - c->in;
+	if (header_len > MAX_HEADER) {
+		*status = 431;
+		return NULL;
+	}
+
+	// The header is parsed in a copy as it may have to be parsed again once
+	// the body is complete
+	struct http_request *r = calloc(1, sizeof(*r));
+	struct buf params = { 0 }, body = { 0 };
+	size_t *offsets = NULL, count = 0;
+	char *h = malloc(header_len + 1);
+	if (r == NULL || h == NULL)
+		goto error;
+	memcpy(h, c->in, header_len);
+	h[header_len] = 0;
+	end = h + header_len - 4;
+
+	// Request line
+	char *line = h, *eol = memmem(line, header_len, "\r\n", 2);
+	char *method = line, *target = memchr(line, ' ', eol - line);
+	if (target == NULL)
+		goto bad;
+	*target++ = 0;
+	char *version = memchr(target, ' ', eol - target);
+	if (version == NULL)
+		goto bad;
+	*version++ = 0;
+	*eol = 0;
+	if (strcmp(version, "HTTP/1.1") == 0)
+		r->keep_alive = 1;
+	else if (strcmp(version, "HTTP/1.0") == 0)
+		r->http10 = 1;
+	else
+		goto bad;
+	r->head = strcmp(method, "HEAD") == 0;
+
+	// Absolute form
+	if (strncmp(target, "http://", 7) == 0 || strncmp(target, "https://", 8) == 0) {
+		target = strchr(target + 8, '/');
+		if (target == NULL)
+			target = "/";
+	}
+	if (*target != '/')
+		goto bad;
+	char *query = strchr(target, '?');
+	if (query != NULL)
+		*query++ = 0;
+	if (decode_path(target) < 0)
+		goto bad;
+
+	if (add_param(&params, &offsets, &count, "REQUEST_METHOD" , 14, method , strlen(method )) < 0 ||
+	    add_param(&params, &offsets, &count, "PATH_INFO"      ,  9, target , strlen(target )) < 0 ||
+	    add_param(&params, &offsets, &count, "QUERY_STRING"   , 12, query ? query : "",
+	              query ? strlen(query) : 0) < 0 ||
+	    add_param(&params, &offsets, &count, "SERVER_PROTOCOL", 15, version, strlen(version)) < 0 ||
+	    add_param(&params, &offsets, &count, "REMOTE_ADDR"    , 11, c->addr, strlen(c->addr)) < 0)
+		goto error;
+
+	// Headers
+	ssize_t content_length = -1;
+	int chunked = 0, expect = 0;
+	for (line = eol + 2; line < end + 2; line = eol + 2) {
+		eol = memmem(line, end + 2 - line, "\r\n", 2);
+		*eol = 0;
+		char *colon = strchr(line, ':');
+		if (colon == NULL || colon == line)
+			goto bad;
+		char *value = colon + 1;
+		while (*value == ' ' || *value == '\t')
+			value++;
+		char *vend = eol;
+		while (vend > value && (vend[-1] == ' ' || vend[-1] == '\t'))
+			vend--;
+		*vend = 0;
+
+		// Convert the name to a CGI variable
+		char name[128] = "HTTP_";
+		size_t nlen = colon - line;
+		if (nlen + 6 > sizeof(name))
+			goto bad;
+		for (size_t i = 0; i < nlen; i++)
+			name[5 + i] = line[i] == '-' ? '_' : toupper((unsigned char)line[i]);
+		name[5 + nlen] = 0;
+
+		if (strcmp(name, "HTTP_CONTENT_LENGTH") == 0) {
+			char *e;
+			content_length = strtol(value, &e, 10);
+			if (*e != 0 || content_length < 0)
+				goto bad;
+			continue;
+		}
+		if (strcmp(name, "HTTP_TRANSFER_ENCODING") == 0) {
+			if (strcasecmp(value, "chunked") != 0)
+				goto bad;
+			chunked = 1;
+			continue;
+		}
+		if (strcmp(name, "HTTP_CONNECTION") == 0) {
+			if (strcasecmp(value, "close") == 0)
+				r->keep_alive = 0;
+			else if (strcasecmp(value, "keep-alive") == 0)
+				r->keep_alive = 1;
+		}
+		if (strcmp(name, "HTTP_EXPECT") == 0)
+			expect = strcasecmp(value, "100-continue") == 0;
+		// CONTENT_TYPE doesn't have the prefix
+		char *n = strcmp(name, "HTTP_CONTENT_TYPE") == 0 ? name + 5 : name;
+		if (add_param(&params, &offsets, &count, n, strlen(n), value, vend - value) < 0)
+			goto error;
+	}
+
+	// Body
+	size_t consumed = header_len;
+	if (chunked) {
+		ssize_t n = decode_chunked(c, c->in + header_len, c->in_len - header_len);
+		if (n < 0) {
+			*status = 413;
+			goto error;
+		}
+		if (n == 0)
+			goto incomplete;
+		consumed += n;
+		body = c->body;
+		c->body = (struct buf){ 0 };
+		reset_body(c);
+	} else if (content_length > 0) {
+		if (content_length > MAX_BODY) {
+			*status = 413;
+			goto error;
+		}
+		if (c->in_len - header_len < (size_t)content_length)
+			goto incomplete;
+		if (buf_add(&body, c->in + header_len, content_length) < 0)
+			goto error;
+		consumed += content_length;
+	}
+	char len[32];
+	snprintf(len, sizeof(len), "%lu", body.len);
+	if (add_param(&params, &offsets, &count, "CONTENT_LENGTH", 14, len, strlen(len)) < 0)
+		goto error;
+
+	r->params = malloc((count + 1) * sizeof(*r->params));
+	if (r->params == NULL)
+		goto error;
+	for (size_t i = 0; i < count; i++)
+		r->params[i] = params.buf + offsets[i];
+	r->params[count] = NULL;
+	r->param_buf = params.buf;
+	r->body      = body.buf;
+	r->body_len  = body.len;
+	r->conn      = c;
+	free(offsets);
+	free(h);
+
+	memmove(c->in, c->in + consumed, c->in_len - consumed);
+	c->in_len   -= consumed;
+	c->continued = 0;
+	return r;
+
+incomplete:
+	if (expect && !c->continued) {
+		const char *msg = "HTTP/1.1 100 Continue\r\n\r\n";
+		send(c->fd, msg, strlen(msg), MSG_NOSIGNAL | MSG_DONTWAIT);
+		c->continued = 1;
+	}
+	goto error;
+bad:
+	*status = 400;
+	goto error;
+error:
+	free(h);
+	free(offsets);
+	free(params.buf);
+	free(body.buf);
+	free(r);
+	return NULL;
+}
+
+
+/*
+ * Hands the next request in the input buffer to a thread, if it is complete.
+ * Must be called with the lock of the connection held.
+ */
+static void dispatch_next(struct conn *c)
+{
+	if (c->busy || c->closing || c->in_len == 0)
+		return;
+	int status;
+	struct http_request *r = parse_request(c, &status);
+	if (r == NULL) {
+		if (status != 0)
+			reject(c, status);
+		return;
+	}
+	c->busy = 1;
+	c->refs++;
+
+	struct http_server *s = c->server;
+	pthread_mutex_lock(&s->lock);
+	if (s->ready_tail != NULL)
+		s->ready_tail->next = r;
+	else
+		s->ready_head = r;
+	s->ready_tail = r;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+
+/*
+ * Reads all available input.
+ *
+ * Returns: -1 if the connection should be closed.
+ */
+static int read_conn(struct conn *c)
+{
+	// The buffer of the connection may be used by a thread that is done with
+	// a request, so read into a buffer of our own first
+	char buf[1 << 14];
+	while (1) {
+		ssize_t n = read(c->fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n <= 0)
+			return -1;
+
+		pthread_mutex_lock(&c->lock);
+		if (c->in_len + n > c->in_cap) {
+			size_t cap = c->in_cap > 0 ? c->in_cap : sizeof(buf);
+			while (c->in_len + n > cap)
+				cap *= 2;
+			char *in = cap <= MAX_BUFFER ? realloc(c->in, cap) : NULL;
+			if (in == NULL) {
+				// Too many pipelined requests
+				pthread_mutex_unlock(&c->lock);
+				return -1;
+			}
+			c->in     = in;
+			c->in_cap = cap;
+		}
+		memcpy(c->in + c->in_len, buf, n);
+		c->in_len += n;
+		dispatch_next(c);
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+
+/*
+ * Stops reading from a connection. Requests that were already read are still
+ * answered.
+ */
+static void conn_close(struct conn *c)
+{
+	struct http_server *s = c->server;
+	poller_del(s->poller, c->fd);
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		s->conns = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	pthread_mutex_lock(&c->lock);
+	c->eof = 1;
+	dispatch_next(c);
+	pthread_mutex_unlock(&c->lock);
+	conn_unref(c);
+}
+
+
+static void accept_conns(struct http_server *s)
+{
+	while (1) {
+		struct sockaddr_storage addr;
+		socklen_t len = sizeof(addr);
+		int fd = poller_accept(s->listen_fd, (struct sockaddr *)&addr, &len);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("Failed to accept connection");
+			return;
+		}
+		struct conn *c = calloc(1, sizeof(*c));
+		if (c == NULL) {
+			close(fd);
+			continue;
+		}
+		c->fd     = fd;
+		c->refs   = 1;
+		c->server = s;
+		pthread_mutex_init(&c->lock, NULL);
+		if (addr.ss_family == AF_INET)
+			inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, c->addr, sizeof(c->addr));
+		else if (addr.ss_family == AF_INET6)
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, c->addr, sizeof(c->addr));
+		if (poller_add(s->poller, fd, c, POLLER_IN) < 0) {
+			perror("Failed to add connection");
+			conn_unref(c);
+			continue;
+		}
+		c->deadline = now_ms() + READ_TIMEOUT;
+		c->next     = s->conns;
+		if (s->conns != NULL)
+			s->conns->prev = c;
+		s->conns    = c;
+	}
+}
+
+
+/*
+ * Closes the connections that didn't send a complete request in time, so a
+ * slow client can't hold on to one for ever.
+ */
+static void close_expired(struct http_server *s)
+{
+	int64_t now = now_ms();
+	for (struct conn *c = s->conns, *next; c != NULL; c = next) {
+		next = c->next;
+		pthread_mutex_lock(&c->lock);
+		int expired = !c->busy && now >= c->deadline;
+		pthread_mutex_unlock(&c->lock);
+		if (expired)
+			conn_close(c);
+	}
+}
+
+
+/*
+ * Output
+ */
+
+/*
+ * Converts the CGI headers to a HTTP response header and sends it.
+ */
+static void send_header(struct http_request *r, const char *hdr, size_t len)
+{
+	struct buf out = { 0 }, rest = { 0 };
+	int status = 200, has_length = 0;
+	for (const char *line = hdr, *end = hdr + len; line < end; ) {
+		const char *eol = memmem(line, end - line, "\r\n", 2);
+		if (eol == NULL || eol == line)
+			break;
+		if (strncasecmp(line, "Status:", 7) == 0) {
+			status = atoi(line + 7);
+		} else {
+			if (strncasecmp(line, "Content-Length:", 15) == 0)
+				has_length = 1;
+			buf_add(&rest, line, eol + 2 - line);
+		}
+		line = eol + 2;
+	}
+
+	r->no_body = r->head || status == 204 || status == 304 || status < 200;
+	if (!r->no_body && !has_length) {
+		if (r->http10)
+			r->keep_alive = 0;
+		else
+			r->chunked = 1;
+	}
+
+	char line[128];
+	snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", status, reason(status));
+	buf_add(&out, line, strlen(line));
+	if (rest.len > 0)
+		buf_add(&out, rest.buf, rest.len);
+	if (r->chunked)
+		buf_add(&out, "Transfer-Encoding: chunked\r\n", 28);
+	if (r->keep_alive)
+		buf_add(&out, "Connection: keep-alive\r\n\r\n", 26);
+	else
+		buf_add(&out, "Connection: close\r\n\r\n", 21);
+
+	if (out.buf != NULL) {
+		struct iovec iov = { out.buf, out.len };
+		send_all(r->conn, &iov, 1, !r->no_body);
+	} else {
+		r->conn->broken = 1;
+	}
+	free(out.buf);
+	free(rest.buf);
+	r->hdr_done = 1;
+}
+
+
+static void send_body(struct http_request *r, const char *buf, size_t n)
+{
+	if (r->no_body || n == 0)
+		return;
+	if (!r->chunked) {
+		struct iovec iov = { (char *)buf, n };
+		send_all(r->conn, &iov, 1, 0);
+		return;
+	}
+	char size[32];
+	struct iovec iov[3] = {
+		{ size, snprintf(size, sizeof(size), "%lx\r\n", n) },
+		{ (char *)buf, n },
+		{ "\r\n", 2 },
+	};
+	send_all(r->conn, iov, 3, 0);
+}
+
+
+/*
+ * Server
+ */
+int http_listen(const char *addr)
+{
+	char host[256];
+	const char *port = strrchr(addr, ':');
+	if (port == NULL || (size_t)(port - addr) >= sizeof(host))
+		return -1;
+	memcpy(host, addr, port - addr);
+	host[port - addr] = 0;
+	port++;
+	// Strip the brackets around IPv6 addresses
+	char *h = host;
+	if (*h == '[' && h[strlen(h) - 1] == ']') {
+		h[strlen(h) - 1] = 0;
+		h++;
+	}
+
+	struct addrinfo hints = {
+		.ai_family   = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags    = AI_PASSIVE,
+	}, *res;
+	if (getaddrinfo(*h != 0 ? h : NULL, port, &hints, &res) != 0)
+		return -1;
+	int fd = -1;
+	for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+
+http_server http_create(int listen_fd)
+{
+	struct http_server *s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	s->listen_fd = listen_fd;
+	s->poller    = poller_create();
+	if (s->poller == NULL) {
+		free(s);
+		return NULL;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	// The socket may be shared with other processes
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+	if (poller_add_listener(s->poller, listen_fd) < 0) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+
+void *http_run(void *server)
+{
+	struct http_server *s = server;
+	struct poller_event events[64];
+	int64_t next_check = now_ms() + 1000;
+	while (1) {
+		int n = poller_wait(s->poller, events, 64, 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Failed to wait for events");
+			return NULL;
+		}
+		for (int i = 0; i < n; i++) {
+			struct conn *c = events[i].ptr;
+			if (c == NULL)
+				accept_conns(s);
+			else if (read_conn(c) < 0)
+				conn_close(c);
+		}
+		// The deadlines are checked about once a second
+		if (now_ms() >= next_check) {
+			close_expired(s);
+			next_check = now_ms() + 1000;
+		}
+	}
+}
+
+
+http_request http_accept(http_server s)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->ready_head == NULL)
+		pthread_cond_wait(&s->cond, &s->lock);
+	struct http_request *r = s->ready_head;
+	s->ready_head = r->next;
+	if (s->ready_head == NULL)
+		s->ready_tail = NULL;
+	pthread_mutex_unlock(&s->lock);
+	r->next = NULL;
+	return r;
+}
+
+
+const char *http_getparam(http_request r, const char *name)
+{
+	size_t n = strlen(name);
+	for (char **p = r->params; *p != NULL; p++) {
+		if (strncmp(*p, name, n) == 0 && (*p)[n] == '=')
+			return *p + n + 1;
+	}
+	return NULL;
+}
+
+
+size_t http_read(http_request r, char *buf, size_t n)
+{
+	if (n > r->body_len - r->body_pos)
+		n = r->body_len - r->body_pos;
+	memcpy(buf, r->body + r->body_pos, n);
+	r->body_pos += n;
+	return n;
+}
+
+
+void http_write(http_request r, const char *buf, size_t n)
+{
+	if (r->hdr_done) {
+		send_body(r, buf, n);
+		return;
+	}
+
+	// Collect the headers until the empty line
+	char *hdr = realloc(r->hdr, r->hdr_len + n);
+	if (hdr == NULL)
+		return;
+	memcpy(hdr + r->hdr_len, buf, n);
+	size_t from = r->hdr_len > 3 ? r->hdr_len - 3 : 0;
+	r->hdr      = hdr;
+	r->hdr_len += n;
+	char *end = memmem(hdr + from, r->hdr_len - from, "\r\n\r\n", 4);
+	if (end == NULL)
+		return;
+	size_t len = end + 4 - hdr;
+	send_header(r, hdr, len);
+	send_body(r, hdr + len, r->hdr_len - len);
+}
+
+
+int http_sendfile(http_request r, int fd, off_t offset, size_t length)
+{
+#ifdef __linux__
+	if (!r->hdr_done)
+		return -1;
+	if (r->no_body)
+		return 0;
+	struct conn *c = r->conn;
+	if (r->chunked) {
+		char size[32];
+		struct iovec iov = { size, snprintf(size, sizeof(size), "%lx\r\n", length) };
+		send_all(c, &iov, 1, 1);
+	}
+	while (length > 0 && !c->broken) {
+		ssize_t n = sendfile(c->fd, fd, &offset, length);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			struct pollfd p = { .fd = c->fd, .events = POLLOUT };
+			if ((errno != EAGAIN && errno != EWOULDBLOCK) || poll(&p, 1, WRITE_TIMEOUT) <= 0)
+				c->broken = 1;
+			continue;
+		}
+		if (n == 0)
+			// The file was truncated
+			c->broken = 1;
+		length -= n;
+	}
+	if (r->chunked) {
+		struct iovec iov = { "\r\n", 2 };
+		send_all(c, &iov, 1, 0);
+	}
+	return 0;
+#else
+	// The caller reads the file instead
+	return -1;
+#endif
+}
+
+
+void http_finish(http_request r)
+{
+	struct conn *c = r->conn;
+	if (!r->hdr_done) {
+		const char *hdr = "Status: 500\r\nContent-Length: 0\r\n\r\n";
+		send_header(r, hdr, strlen(hdr));
+	} else if (r->chunked) {
+		struct iovec iov = { "0\r\n\r\n", 5 };
+		send_all(c, &iov, 1, 0);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	c->busy     = 0;
+	c->deadline = now_ms() + READ_TIMEOUT;
+	if (!r->keep_alive || c->broken) {
+		// The event loop closes the connection once it notices
+		shutdown(c->fd, SHUT_RDWR);
+		c->closing = 1;
+	}
+	dispatch_next(c);
+	pthread_mutex_unlock(&c->lock);
+	request_free(r);
+	conn_unref(c);
+}
@@ -1,15 +1,34 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fastcgi.h>
-#include <fcgi_stdio.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
 #include <time.h>
+#include <zlib.h>
 #include "../include/mime.h"
+#include "../include/accesslog.h"
 #include "../include/article.h"
+#include "../include/cache.h"
+#include "../include/fcgi.h"
+#include "../include/fileio.h"
+#include "../include/http.h"
+#include "../include/metrics.h"
+#include "../include/query.h"
+#include "../include/trace.h"
 #include "../include/dict.h"
 #include "temp-alloc.h"
 #include "temp/dict.h"
@@ -24,17 +43,60 @@
 #define ENTRY_TEMP   TEMPLATE_DIR "article_list.html"
 #define COMMENT_TEMP TEMPLATE_DIR "comment.html"
 #define RESPONSE_USE_TEMPLATE 0x1
+#define RESPONSE_GZIP         0x2
+#define RESPONSE_BR           0x4
+// Set on plain static files that have a compressed sibling (the encoding << 2)
+#define RESPONSE_HAS_GZIP     0x8
+#define RESPONSE_HAS_BR       0x10
+#define BODY_MARKER  "\x01soup-body\x01"
+#define MAX_PAGE_SIZE 1000
+
+
+// Structs
+typedef struct templates {
+	cinja_template main;
+	cinja_template error;
+	cinja_template article;
+	cinja_template entry;
+	cinja_template comment;
+	string main_head;
+	string main_tail;
+} *templates;
+
+struct hazard {
+	_Atomic(art_root)  root;
+	_Atomic(templates) temps;
+};
 
 
 // Global variables
-cinja_template   main_temp;
-cinja_template   error_temp;
-cinja_template     art_temp;
-cinja_template   entry_temp;
-cinja_template comment_temp;
-art_root          blog_root;
+_Atomic(templates) site_temps;
+_Atomic(art_root)  blog_root;
+struct hazard     *hazards;
+__thread templates temps;
+__thread int       worker_id;
+cache          static_cache;
+cache            page_cache;
 char redirect_tls = 0;
 string author_name;
+size_t cache_size = 1 << 23;
+size_t page_cache_size = 1 << 23;
+size_t arena_size = 1 << 27;
+size_t stream_threshold = 1 << 16;
+size_t page_size = 20;
+size_t comment_cache_size = 1 << 24;
+int workers = 1;
+int prefork = 0;
+volatile sig_atomic_t terminate = 0;
+char *listen_addr = NULL;
+int listen_fd = FCGI_LISTENSOCK_FILENO;
+fcgi_server fcgi_srv;
+http_server http_srv;
+char *metrics_path  = "_soup/metrics";
+char *metrics_allow = "127.0.0.1 ::1 ::ffff:127.0.0.1";
+char *access_log = NULL;
+size_t access_log_size = 1 << 24;
+int access_log_files = 4;
 
 
 // Macros
@@ -42,11 +104,30 @@ string author_name;
 
 
 // Structs
+typedef struct request {
+	// At most one is set. Neither is set when running as a CGI program
+	fcgi_request fcgi;
+	http_request http;
+	// Set by handle_request for the metrics and the access log
+	int status;
+	enum metrics_route route;
+	int cached;
+	size_t bytes;
+} *request;
+
 typedef struct response {
 	cinja_dict headers;
 	string body;
 	int status;
 	int flags;
+	cache cache;
+	cache_entry entry;
+	string head;
+	string tail;
+	time_t modified;
+	int fd;
+	off_t offset;
+	size_t length;
 } *response;
 
 
@@ -56,10 +137,89 @@ static response response_create()
 	r->headers = cinja_temp_dict_create();
 	r->body    = NULL;
 	r->flags   = 0;
+	r->cache   = NULL;
+	r->entry   = NULL;
+	r->head    = NULL;
+	r->tail    = NULL;
+	r->modified = -1;
+	r->fd      = -1;
 	return r;
 }
 
 
+/**
+Request I/O
+
+Requests come from the FastCGI server, the HTTP server or, when running as a
+plain CGI program, from the environment, stdin and stdout.
+
+Large buffers passed to req_write may be sent from where they are, so they
+must stay valid until req_flush is called.
+*/
+
+static const char *req_getenv(request req, const char *name)
+{
+	if (req->fcgi != NULL)
+		return fcgi_getparam(req->fcgi, name);
+	if (req->http != NULL)
+		return http_getparam(req->http, name);
+	return getenv(name);
+}
+
+
+static size_t req_read(request req, char *buf, size_t n)
+{
+	if (req->fcgi != NULL)
+		return fcgi_read(req->fcgi, buf, n);
+	if (req->http != NULL)
+		return http_read(req->http, buf, n);
+	return fread(buf, 1, n, stdin);
+}
+
+
+static void req_write(request req, const char *buf, size_t n)
+{
+	req->bytes += n;
+	if (req->fcgi != NULL)
+		fcgi_write(req->fcgi, buf, n);
+	else if (req->http != NULL)
+		http_write(req->http, buf, n);
+	else
+		fwrite(buf, 1, n, stdout);
+}
+
+
+static void req_flush(request req)
+{
+	if (req->fcgi != NULL)
+		fcgi_flush(req->fcgi);
+	else if (req->http == NULL)
+		fflush(stdout);
+}
+
+
+static void req_printf(request req, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list args, copy;
+	va_start(args, fmt);
+	va_copy(copy, args);
+	int n = vsnprintf(buf, sizeof(buf), fmt, args);
+	if (n >= (int)sizeof(buf)) {
+		// The temporary allocator keeps it alive until the request is done
+		char *b = temp_alloc(n + 1);
+		if (b != NULL) {
+			vsnprintf(b, n + 1, fmt, copy);
+			req_write(req, b, n);
+		}
+	} else if (n > 0) {
+		req_write(req, buf, n);
+	}
+	va_end(copy);
+	va_end(args);
+}
+
+
 static const char *get_error_msg(int status)
 {
 	switch(status) {
@@ -86,14 +246,14 @@ static response get_error_response(response r, int status) {
 	cinja_dict_set(d, temp_string_create("STATUS" ), temp_string_create(buf));
 	cinja_dict_set(d, temp_string_create("MESSAGE"),
 	               temp_string_create(get_error_msg(r->status)));
-	r->body = cinja_temp_render(error_temp, d);
+	r->body = cinja_temp_render(temps->error, d);
 	return r;
 }
 
 
 static string date_to_str(struct date d)
 {
-	static char buf[64];
+	char buf[64];
 	snprintf(buf, sizeof(buf), "%02d-%02d-%02d %02d:%02d", d.year, d.month, d.day, d.hour, d.min);
 	return temp_string_create(buf);
 }
@@ -108,6 +268,53 @@ static cinja_template load_temp(char *file)
 }
 
 
+static void free_templates(templates t)
+{
+	if (t->main   ) cinja_free(t->main   );
+	if (t->error  ) cinja_free(t->error  );
+	if (t->article) cinja_free(t->article);
+	if (t->entry  ) cinja_free(t->entry  );
+	if (t->comment) cinja_free(t->comment);
+	free(t->main_head);
+	free(t->main_tail);
+	free(t);
+}
+
+
+static templates load_templates()
+{
+	templates t = malloc(sizeof(*t));
+	if (!t)
+		return NULL;
+	t->main    = load_temp(   MAIN_TEMP);
+	t->error   = load_temp(  ERROR_TEMP);
+	t->article = load_temp(ARTICLE_TEMP);
+	t->comment = load_temp(COMMENT_TEMP);
+	t->entry   = load_temp(  ENTRY_TEMP);
+	t->main_head = NULL;
+	t->main_tail = NULL;
+	if (!t->main || !t->error || !t->article || !t->comment || !t->entry) {
+		free_templates(t);
+		return NULL;
+	}
+
+	// Split the output of the main template around BODY, so pages can be
+	// wrapped by writing the parts around the body instead of rendering the
+	// whole page again. If BODY isn't used exactly once, the main template is
+	// rendered for every page instead.
+	cinja_dict d = cinja_temp_dict_create();
+	cinja_dict_set(d, temp_string_create("BODY"), temp_string_create(BODY_MARKER));
+	string page = cinja_temp_render(t->main, d);
+	char *m = page ? strstr(page->buf, BODY_MARKER) : NULL;
+	if (m != NULL && strstr(m + 1, BODY_MARKER) == NULL) {
+		size_t i = m - page->buf, j = i + sizeof(BODY_MARKER) - 1;
+		t->main_head = string_copy(page, 0, i);
+		t->main_tail = string_copy(page, j, page->len);
+	}
+	return t;
+}
+
+
 static int setup()
 {
 	// Load the configuration file
@@ -143,39 +350,166 @@ static int setup()
 				author_name = string_create(orgptr, ptr - orgptr);
 				break;
 			}
+			if (strncmp(orgptr, "listen", 6) == 0) {
+				orgptr = ptr;
+				while (*ptr != '\n' && *ptr != 0 && *ptr != ' ')
+					ptr++;
+				listen_addr = strndup(orgptr, ptr - orgptr);
+				break;
+			}
+		case 7:
+			if (strncmp(orgptr, "workers", 7) == 0) {
+				workers = atoi(ptr);
+				if (workers < 1)
+					RETURN_ERROR(-1, "Invalid number of workers in soup.conf:%lu", line);
+				break;
+			}
+			if (strncmp(orgptr, "prefork", 7) == 0) {
+				prefork = atoi(ptr);
+				if (prefork < 0)
+					RETURN_ERROR(-1, "Invalid number of processes in soup.conf:%lu", line);
+				break;
+			}
+		case 9:
+			if (strncmp(orgptr, "page_size", 9) == 0) {
+				page_size = strtoul(ptr, NULL, 0);
+				if (page_size < 1 || page_size > MAX_PAGE_SIZE)
+					RETURN_ERROR(-1, "Invalid page size in soup.conf:%lu", line);
+				break;
+			}
+		case 10:
+			if (strncmp(orgptr, "access_log", 10) == 0) {
+				orgptr = ptr;
+				while (*ptr != '\n' && *ptr != 0 && *ptr != ' ')
+					ptr++;
+				access_log = ptr - orgptr == 3 && strncmp(orgptr, "off", 3) == 0 ?
+				             NULL : strndup(orgptr, ptr - orgptr);
+				break;
+			}
+			if (strncmp(orgptr, "cache_size", 10) == 0) {
+				cache_size = strtoul(ptr, NULL, 0);
+				break;
+			}
+			if (strncmp(orgptr, "arena_size", 10) == 0) {
+				arena_size = strtoul(ptr, NULL, 0);
+				break;
+			}
+		case 12:
+			if (strncmp(orgptr, "metrics_path", 12) == 0) {
+				orgptr = ptr;
+				while (*ptr != '\n' && *ptr != 0 && *ptr != ' ')
+					ptr++;
+				if (*orgptr == '/')
+					orgptr++;
+				metrics_path = ptr - orgptr == 3 && strncmp(orgptr, "off", 3) == 0 ?
+				               NULL : strndup(orgptr, ptr - orgptr);
+				break;
+			}
+		case 13:
+			if (strncmp(orgptr, "metrics_allow", 13) == 0) {
+				orgptr = ptr;
+				while (*ptr != '\n' && *ptr != 0)
+					ptr++;
+				metrics_allow = strndup(orgptr, ptr - orgptr);
+				break;
+			}
+		case 14:
+			// The old name of stream_threshold
+			if (strncmp(orgptr, "mmap_threshold", 14) == 0) {
+				stream_threshold = strtoul(ptr, NULL, 0);
+				break;
+			}
+		case 15:
+			if (strncmp(orgptr, "page_cache_size", 15) == 0) {
+				page_cache_size = strtoul(ptr, NULL, 0);
+				break;
+			}
+			if (strncmp(orgptr, "commit_interval", 15) == 0) {
+				art_commit_interval = strtoul(ptr, NULL, 0);
+				break;
+			}
+			if (strncmp(orgptr, "access_log_size", 15) == 0) {
+				access_log_size = strtoul(ptr, NULL, 0);
+				break;
+			}
+		case 16:
+			if (strncmp(orgptr, "access_log_files", 16) == 0) {
+				access_log_files = atoi(ptr);
+				if (access_log_files < 1)
+					RETURN_ERROR(-1, "Invalid number of access log files in soup.conf:%lu", line);
+				break;
+			}
+			if (strncmp(orgptr, "stream_threshold", 16) == 0) {
+				stream_threshold = strtoul(ptr, NULL, 0);
+				break;
+			}
+		case 18:
+			if (strncmp(orgptr, "comment_cache_size", 18) == 0) {
+				comment_cache_size = strtoul(ptr, NULL, 0);
+				break;
+			}
 		default:
 			RETURN_ERROR(-1, "Unknown option: %*s", (int)(ptr - orgptr), orgptr);
 		}
 	}
 
 	// Load the templates
-	   main_temp = load_temp(   MAIN_TEMP);
-	  error_temp = load_temp(  ERROR_TEMP);
-	    art_temp = load_temp(ARTICLE_TEMP);
-	comment_temp = load_temp(COMMENT_TEMP);
-	  entry_temp = load_temp(  ENTRY_TEMP);
-	if (!main_temp || !error_temp || !art_temp || !comment_temp || !entry_temp)
+	templates t = load_templates();
+	if (!t)
+		return -1;
+	atomic_store(&site_temps, t);
+	static_cache = cache_create(cache_size);
+	  page_cache = cache_create(page_cache_size);
+	if (!static_cache || !page_cache)
+		return -1;
+	art_root root = art_load(temp_string_create("blog"));
+	if (!root)
+		return -1;
+	root->comment_cache_max = comment_cache_size;
+	atomic_store(&blog_root, root);
+	hazards = calloc(workers, sizeof(*hazards));
+	if (!hazards || metrics_init(workers) < 0)
 		return -1;
-	blog_root = art_load(temp_string_create("blog"));
-	return blog_root ? 0 : -1;
+	metrics_add_cache("static", static_cache);
+	metrics_add_cache("page"  ,   page_cache);
+	return 0;
+}
+
+
+/**
+Wrap the body of a response in the main template, if needed. If possible, the
+parts of the main template around the body are set as the head and tail of the
+response, which are written directly around the body.
+
+Returns: 0 on success, -1 if the template couldn't be rendered.
+*/
+static int wrap_response(response r)
+{
+	if (!(r->flags & RESPONSE_USE_TEMPLATE))
+		return 0;
+	if (temps->main_head && temps->main_tail) {
+		r->head   = temps->main_head;
+		r->tail   = temps->main_tail;
+		r->flags &= ~RESPONSE_USE_TEMPLATE;
+		return 0;
+	}
+	cinja_dict d = cinja_temp_dict_create();
+	cinja_dict_set(d, temp_string_create("BODY"), r->body);
+	TRACE_BEGIN(render_main);
+	r->body   = cinja_temp_render(temps->main, d);
+	TRACE_END(render_main);
+	r->flags &= ~RESPONSE_USE_TEMPLATE;
+	return r->body ? 0 : -1;
 }
 
 
 static int set_article_dict(cinja_dict d, article art, int load_body) {
 	if (load_body) {
-		struct stat statbuf;
-		int fd = open(art->file->buf, O_RDONLY);
-		if (fd < 0)
+		TRACE_BEGIN(read_article);
+		string buf = file_read(art->file->buf, NULL);
+		TRACE_END(read_article);
+		if (!buf)
 			return -1;
-		fstat(fd, &statbuf);
-		string buf = temp_alloc(sizeof(buf->len) + statbuf.st_size + 1);
-		if (!buf) {
-			close(fd);
-			return -1;
-		}
-		buf->len = statbuf.st_size;
-		read(fd, buf->buf, statbuf.st_size);
-		buf->buf[buf->len] = 0;
 		cinja_dict_set(d, temp_string_create("BODY"), buf);
 	}
 
@@ -213,7 +547,7 @@ static cinja_dict _comment_to_dict(comment c)
 			cinja_list_add(replies, _comment_to_dict(d));
 		}
 		cinja_temp_dict_set(d, temp_string_create("REPLIES"), replies);
-		cinja_temp_dict_set(d, temp_string_create("comment"), comment_temp);
+		cinja_temp_dict_set(d, temp_string_create("comment"), temps->comment);
 	}
 	return d;
 }
@@ -234,97 +568,334 @@ static cinja_list get_comments(art_root root, const string uri)
 
 
 /**
-Query
+Conditional requests
+
+The validators of a response are derived from the files it was generated from,
+which are the same files the caches depend on. The ETag is a hash of the key
+and the mtime, size and inode of each file, so it changes whenever a cached
+entry would go stale.
 */
 
-static char hex_to_char(const char *s)
+static void set_validators(response r, const string key,
+                           const struct cache_dep *deps, size_t dep_count)
 {
-	unsigned char c;
-	if ('0' <= *s && *s <= '9')
-		c = (*s - '0') << 4;
-	else if ('A' <= *s && *s <= 'F')
-		c = (*s - 'A' + 10) << 4;
-	else
-		c = (*s - 'a' + 10) << 4;
-	s++;
-	if ('0' <= *s && *s <= '9')
-		c += (*s - '0');
-	else if ('A' <= *s && *s <= 'F')
-		c += (*s - 'A' + 10);
-	else
-		c += (*s - 'a' + 10);
-	return c;
+	// FNV-1a
+	uint64_t h = 14695981039346656037u;
+	time_t modified = 0;
+#define HASH(p, n) for (size_t _i = 0; _i < (n); _i++) { \
+		h ^= ((const unsigned char *)(p))[_i]; \
+		h *= 1099511628211u; \
+	}
+	HASH(key->buf, key->len);
+	for (size_t i = 0; i < dep_count; i++) {
+		const struct cache_dep *d = &deps[i];
+		HASH(&d->mtime, sizeof(d->mtime));
+		HASH(&d->size , sizeof(d->size ));
+		HASH(&d->ino  , sizeof(d->ino  ));
+		if (d->size != -1 && d->mtime > modified)
+			modified = d->mtime;
+	}
+#undef HASH
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "\"%016llx\"", (unsigned long long)h);
+	cinja_dict_set(r->headers, temp_string_create("ETag"), temp_string_create(buf));
+	struct tm tm;
+	gmtime_r(&modified, &tm);
+	strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	cinja_dict_set(r->headers, temp_string_create("Last-Modified"), temp_string_create(buf));
+	r->modified = modified;
 }
 
 
-static string copy_query_field(const char **pptr, char delim)
+/**
+Check whether the client already has the response, in which case a 304 can be
+sent instead. If-None-Match takes precedence over If-Modified-Since.
+*/
+static int is_not_modified(request req, response r)
 {
-	const char *ptr = *pptr;
-	size_t s = 4096, i = 0;
-	string v = temp_alloc(sizeof(v->len) + s + 1);
-	if (!v)
-		return NULL;
+	if (r->status != 200 || r->modified < 0)
+		return 0;
+
+	const char *inm = req_getenv(req, "HTTP_IF_NONE_MATCH");
+	if (inm != NULL) {
+		string etag = cinja_dict_get(r->headers, temp_string_create("ETag")).value;
+		const char *p = inm;
+		while (*p != 0) {
+			while (*p == ' ' || *p == ',')
+				p++;
+			if (*p == '*')
+				return 1;
+			// Weak comparison is fine for GET
+			if (strncmp(p, "W/", 2) == 0)
+				p += 2;
+			if (strncmp(p, etag->buf, etag->len) == 0 &&
+			    (p[etag->len] == 0 || p[etag->len] == ',' || p[etag->len] == ' '))
+				return 1;
+			while (*p != 0 && *p != ',')
+				p++;
+		}
+		return 0;
+	}
 
-	const char *p = ptr;
-	for (v->len = 0; *ptr != delim && *ptr != 0; v->len++) {
-		if (s <= i) {
-			// TODO
-			return NULL;
-/*
-			string tmp = realloc(v, s * 3 / 2);
-			if (!tmp) {
-				free(v);
-				return NULL;
-			}
-			v = tmp;
-			s = s * 3 / 2;
+	const char *ims = req_getenv(req, "HTTP_IF_MODIFIED_SINCE");
+	if (ims != NULL) {
+		struct tm tm = { 0 };
+		const char *end = strptime(ims, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+		if (end != NULL && *end == 0)
+			return r->modified <= timegm(&tm);
+	}
+	return 0;
+}
+
+
+/**
+Content encodings
+
+Static files may have precompressed siblings (e.g. `style.css.gz`) which are
+sent instead if the client accepts them. Pages are compressed with gzip once
+and kept in the page cache next to the plain version.
 */
+
+static const struct encoding {
+	int flag;
+	const char *name;
+	const char *ext;
+} encodings[] = {
+	{ RESPONSE_BR  , "br"  , ".br" },
+	{ RESPONSE_GZIP, "gzip", ".gz" },
+};
+
+
+static int accepted_encodings(const char *header)
+{
+	int accepted = 0;
+	const char *p = header;
+	while (p != NULL && *p != 0) {
+		while (*p == ' ' || *p == ',')
+			p++;
+		const char *name = p;
+		while (*p != 0 && *p != ',' && *p != ';' && *p != ' ')
+			p++;
+		size_t len = p - name;
+		// An encoding with a quality of 0 is refused
+		int refused = 0;
+		while (*p != 0 && *p != ',') {
+			if (strncmp(p, "q=", 2) == 0)
+				refused = strtod(p + 2, NULL) == 0;
+			p++;
 		}
-		if (*ptr == '+' || *ptr == '%') {
-			if (*ptr == '+') {
-				v->buf[v->len] = ' ';
-			} else {
-				ptr++;
-				v->buf[v->len] = hex_to_char(ptr);
-				ptr++;
-			}
-			p = ptr + 1;
-		} else {
-			v->buf[v->len] = *ptr;
+		if (refused || len == 0)
+			continue;
+		for (size_t i = 0; i < sizeof(encodings) / sizeof(*encodings); i++) {
+			if ((len == 1 && *name == '*') ||
+			    (strlen(encodings[i].name) == len && strncmp(encodings[i].name, name, len) == 0))
+				accepted |= encodings[i].flag;
 		}
-		ptr++;
 	}
-	v->buf[v->len] = 0;
+	return accepted;
+}
+
 
-	*pptr = ptr + 1;
-	return v;
+/**
+Get the key of the variant of a cache entry with the given encoding. A tab
+can't be part of a URI, so these never clash with plain entries.
+*/
+static string encoded_key(const string key, const struct encoding *enc)
+{
+	string components[3] = { key, temp_string_create("\t"), temp_string_create(enc->name) };
+	return temp_string_concat(components, 3);
 }
 
 
-static cinja_dict parse_query(const char *q)
+/**
+Compress the concatenation of a number of strings with gzip.
+
+Returns: the compressed string or NULL on failure.
+*/
+static string gzip_parts(const string *parts, size_t count)
 {
-	const char *ptr = q;
-	cinja_dict d = cinja_temp_dict_create();
-	while (*ptr != 0) {
-		string key = copy_query_field(&ptr, '=');
-		string val = copy_query_field(&ptr, '&');
-		cinja_temp_dict_set(d, key, val);
+	z_stream z = { 0 };
+	if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+	size_t len = 0;
+	for (size_t i = 0; i < count; i++)
+		len += parts[i]->len;
+	size_t max = deflateBound(&z, len);
+	string s = temp_alloc(sizeof(s->len) + max + 1);
+	if (s == NULL) {
+		deflateEnd(&z);
+		return NULL;
 	}
-	return d;
+	z.next_out  = (Bytef *)s->buf;
+	z.avail_out = max;
+	int ret = Z_OK;
+	TRACE_BEGIN(gzip);
+	for (size_t i = 0; i < count; i++) {
+		z.next_in  = (Bytef *)parts[i]->buf;
+		z.avail_in = parts[i]->len;
+		ret = deflate(&z, i + 1 == count ? Z_FINISH : Z_NO_FLUSH);
+	}
+	TRACE_END(gzip);
+	s->len = z.total_out;
+	s->buf[s->len] = 0;
+	deflateEnd(&z);
+	return ret == Z_STREAM_END ? s : NULL;
+}
+
+
+/**
+Add a file a rendered page depends on.
+*/
+static void add_page_dep(struct cache_dep *deps, size_t *count, const string path)
+{
+	struct stat statbuf;
+	int exists = stat(path->buf, &statbuf) == 0;
+	cache_dep_set(&deps[(*count)++], path, exists ? &statbuf : NULL);
+}
+
+
+/**
+Fill in a response from a cache entry.
+*/
+static response serve_entry(response r, cache c, cache_entry e, const string key)
+{
+	if (e->mime != NULL)
+		cinja_dict_set(r->headers, temp_string_create("Content-Type"), e->mime);
+	set_validators(r, key, e->deps, e->dep_count);
+	r->body   = e->body;
+	r->flags  = e->flags;
+	r->status = 200;
+	r->cache  = c;
+	r->entry  = e;
+	return r;
+}
+
+
+/**
+Load an opened file into a response and put it in static_cache. Large files are
+sent straight from the file instead, as are files of which only the headers are
+needed.
+*/
+static response load_file(response r, const string key, int fd, size_t size,
+                          const struct cache_dep *deps, size_t dep_count, int head)
+{
+	set_validators(r, key, deps, dep_count);
+
+	if ((head || size > stream_threshold) && !(r->flags & RESPONSE_USE_TEMPLATE)) {
+		r->fd     = fd;
+		r->offset = 0;
+		r->length = size;
+		r->status = 200;
+		return r;
+	}
+
+	// Load the file
+	r->body = temp_alloc(sizeof(r->body->len) + size + 1);
+	if (!r->body) {
+		close(fd);
+		return get_error_response(r, 500);
+	}
+	TRACE_BEGIN(read_file);
+	ssize_t n = file_read_close(fd, r->body->buf, size);
+	TRACE_END(read_file);
+	if (n < 0)
+		return get_error_response(r, 500);
+	r->body->buf[n] = 0;
+	r->body->len = n;
+
+	// Cache the file
+	string mime = cinja_dict_get(r->headers, temp_string_create("Content-Type")).value;
+	cache_entry e = cache_put(static_cache, key, &r->body, 1, mime, r->flags, deps, dep_count);
+	if (e != NULL)
+		cache_release(static_cache, e);
+
+	r->status = 200;
+	return r;
+}
+
+
+/**
+Check if a URI is a file, a file with an extension added to it (e.g. a
+compressed sibling or a rotated log) or something in a directory.
+*/
+static int matches_file(const string uri, const char *name)
+{
+	size_t n = strlen(name);
+	return strncmp(uri->buf, name, n) == 0 &&
+	       (uri->buf[n] == 0 || uri->buf[n] == '.' || uri->buf[n] == '/');
+}
+
+
+/**
+Check if a URI points to a hidden file or to one of the files of the server
+itself, which are next to the static files. Comment files are under blog/,
+which only serves articles.
+*/
+static int is_private(const string uri)
+{
+	// An absolute path would escape the server root
+	if (uri->buf[0] == '/')
+		return 1;
+	for (size_t i = 0; i < uri->len; i++) {
+		if (uri->buf[i] == '.' && (i == 0 || uri->buf[i - 1] == '/'))
+			return 1;
+	}
+	static const char *names[] = { "soup.conf", "blog.list", "templates" };
+	for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+		if (matches_file(uri, names[i]))
+			return 1;
+	}
+	const char *log = access_log;
+	if (log != NULL && strncmp(log, "./", 2) == 0)
+		log += 2;
+	return log != NULL && *log != '/' && matches_file(uri, log);
 }
 
 
 /**
 Get the static file associated with a URI.
 
+Files are kept in static_cache so that hot files don't need to be read again.
+If the client accepts one of the encodings and the file has a sibling with that
+encoding that is at least as new, the sibling is sent instead.
+
 Returns: A valid response object with as body the contents of the static file.
 */
-static response get_static_file(string uri)
+static response get_static_file(string uri, int accepted, int head)
 {
 	response r = response_create();
 	string path;
 
+	// To clients the files of the server don't exist
+	if (is_private(uri))
+		return get_error_response(r, 404);
+
+	// Check if the file is cached. If the plain file is known to have a
+	// sibling the client accepts, it is only used if the sibling isn't cached.
+	cache_entry e = cache_get(static_cache, uri);
+	for (size_t i = 0; i < sizeof(encodings) / sizeof(*encodings); i++) {
+		const struct encoding *enc = &encodings[i];
+		if (!(accepted & enc->flag) || (e != NULL && !(e->flags & (enc->flag << 2))))
+			continue;
+		string key = encoded_key(uri, enc);
+		cache_entry ee = cache_get(static_cache, key);
+		if (ee != NULL) {
+			if (e != NULL)
+				cache_release(static_cache, e);
+			return serve_entry(r, static_cache, ee, key);
+		}
+		if (e != NULL) {
+			cache_release(static_cache, e);
+			e = NULL;
+			break;
+		}
+	}
+	if (e != NULL)
+		return serve_entry(r, static_cache, e, uri);
+
 	// Get the path to the requested file
+	TRACE_BEGIN(open_file);
 	if (uri->len == 0) {
 		path = temp_string_create("index.html");
 		r->flags = RESPONSE_USE_TEMPLATE;
@@ -348,9 +919,9 @@ static response get_static_file(string uri)
 	const string mime = get_mime_type(path);
 	cinja_dict_set(r->headers, temp_string_create("Content-Type"), mime);
 
-	// Load the file
-	FILE *f = fopen(path->buf, "r");
-	if (!f) {
+	// Open the file
+	int fd = open(path->buf, O_RDONLY);
+	if (fd < 0) {
 		int err;
 		switch (errno) {
 		case ENAMETOOLONG: err = 400; break;
@@ -360,17 +931,55 @@ static response get_static_file(string uri)
 		}
 		return get_error_response(r, err);
 	}
-	fseek(f, 0, SEEK_END);
-	size_t s = ftell(f);
-	fseek(f, 0, SEEK_SET);
-	r->body = temp_alloc(sizeof(r->body->len) + s + 1);
-	fread(r->body->buf, s, 1, f);
-	r->body->buf[s] = 0;
-	fclose(f);
-	r->body->len = s;
+	// Stat before reading so a concurrent change invalidates the entry
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) < 0) {
+		close(fd);
+		return get_error_response(r, 500);
+	}
+	TRACE_END(open_file);
+
+	// Pages are also generated from the main template
+	struct cache_dep deps[1 + sizeof(encodings) / sizeof(*encodings)];
+	size_t dep_count = 0;
+	cache_dep_set(&deps[dep_count++], path, &statbuf);
+	if (r->flags & RESPONSE_USE_TEMPLATE) {
+		add_page_dep(deps, &dep_count, temp_string_create(MAIN_TEMP));
+		return load_file(r, uri, fd, statbuf.st_size, deps, dep_count, head);
+	}
 
-	r->status = 200;
-	return r;
+	// Look for compressed siblings. Their absence is a dependency too, so
+	// creating one invalidates the plain entry.
+	const struct encoding *use = NULL;
+	for (size_t i = 0; i < sizeof(encodings) / sizeof(*encodings); i++) {
+		const struct encoding *enc = &encodings[i];
+		string components[2] = { path, temp_string_create(enc->ext) };
+		struct cache_dep *d = &deps[dep_count];
+		add_page_dep(deps, &dep_count, temp_string_concat(components, 2));
+		if (d->size == -1 || d->mtime < statbuf.st_mtime)
+			continue;
+		r->flags |= enc->flag << 2;
+		if (use == NULL && (accepted & enc->flag))
+			use = enc;
+	}
+	if (use == NULL)
+		return load_file(r, uri, fd, statbuf.st_size, deps, dep_count, head);
+
+	// Send the sibling instead
+	close(fd);
+	string components[2] = { path, temp_string_create(use->ext) };
+	struct cache_dep sdeps[2] = { deps[0] };
+	sdeps[1].path = temp_string_concat(components, 2);
+	fd = open(sdeps[1].path->buf, O_RDONLY);
+	if (fd < 0)
+		return get_error_response(r, 500);
+	if (fstat(fd, &statbuf) < 0) {
+		close(fd);
+		return get_error_response(r, 500);
+	}
+	cache_dep_set(&sdeps[1], sdeps[1].path, &statbuf);
+	r->flags = use->flag;
+	return load_file(r, encoded_key(uri, use), fd, statbuf.st_size, sdeps, 2, head);
 }
 
 
@@ -378,7 +987,7 @@ static response get_static_file(string uri)
 Request handlers
 */
 
-static response handle_post(const string uri)
+static response handle_post(request req, art_root root, const string uri)
 {
 	response r = response_create();
 
@@ -388,19 +997,21 @@ static response handle_post(const string uri)
 	}
 	if (uri->buf[5] == 0)
 		return get_error_response(r, 405);
-	cinja_list ls = art_get(blog_root, temp_string_create(uri->buf + 5));
-	if (ls->count != 1) {
-		cinja_list_free(ls);
+	article *arts;
+	if (art_get(root, temp_string_create(uri->buf + 5), &arts) != 1)
 		return get_error_response(r, 405);
-	}
 
 	// Read the request's body
 	char *body = temp_alloc(0xFFFF);
-	size_t end = fread(body, 1, 0xFFFF, stdin);
+	TRACE_BEGIN(read_body);
+	size_t end = req_read(req, body, 0xFFFF - 1);
+	TRACE_END(read_body);
 	body[end] = 0;
 
 	// Parse the request's body
+	TRACE_BEGIN(parse_form);
 	cinja_dict d = parse_query(body);
+	TRACE_END(parse_form);
 	comment c = temp_alloc(sizeof(*c));
 	string val;
 
@@ -423,7 +1034,7 @@ valid_author_name:
 	string rt_str = cinja_dict_get(d, temp_string_create("reply-to")).value;
 	size_t reply_to = rt_str != NULL ? atoi(rt_str->buf) : -1;
 	time_t t = time(NULL);
-	struct tm *tm = localtime(&t);
+	struct tm tmbuf, *tm = localtime_r(&t, &tmbuf);
 	c->date.year  = tm->tm_year + 11900;
 	c->date.month = tm->tm_mon + 1;
 	c->date.day   = tm->tm_mday;
@@ -431,8 +1042,15 @@ valid_author_name:
 	c->date.min   = tm->tm_min;
 
 	string sub_uri = temp_string_create(uri->buf + 5, uri->len - 5);
-	if (art_add_comment(blog_root, sub_uri, c, reply_to) < 0)
+	TRACE_BEGIN(add_comment);
+	int ret = art_add_comment(root, sub_uri, c, reply_to);
+	TRACE_END(add_comment);
+	if (ret < 0)
 		return get_error_response(r, 500);
+	// Drop the page along with its compressed variants
+	cache_del(page_cache, uri);
+	for (size_t i = 0; i < sizeof(encodings) / sizeof(*encodings); i++)
+		cache_del(page_cache, encoded_key(uri, &encodings[i]));
 
 	r->status = 302;
 	cinja_dict_set(r->headers, temp_string_create("Location"), sub_uri);
@@ -441,148 +1059,947 @@ valid_author_name:
 }
 
 
-static response handle_get(const string uri)
+/**
+Reloading
+
+blog.list and the templates are reloaded when they change. A new article root
+or set of templates is published by swapping blog_root or site_temps. A
+request announces which ones it uses in its worker's slot in hazards, and the
+old ones are only freed once no slot refers to them anymore.
+*/
+
+static art_root acquire()
 {
+	art_root root;
+	do {
+		root = atomic_load(&blog_root);
+		atomic_store(&hazards[worker_id].root, root);
+	} while (root != atomic_load(&blog_root));
+	templates t;
+	do {
+		t = atomic_load(&site_temps);
+		atomic_store(&hazards[worker_id].temps, t);
+	} while (t != atomic_load(&site_temps));
+	temps = t;
+	return root;
+}
 
-	// Check if a blog post is requested
-	if (strncmp("blog", uri->buf, 4) == 0 && (uri->buf[4] == '/' || uri->buf[4] == 0)) {
-		response r = response_create();
-		r->flags = RESPONSE_USE_TEMPLATE;
 
-		// Cut the "blog" part of the uri
-		const string nuri = temp_string_create(uri->buf + (uri->buf[4] == '/' ? 5 : 4));
+static void release()
+{
+	atomic_store(&hazards[worker_id].root , NULL);
+	atomic_store(&hazards[worker_id].temps, NULL);
+	temps = NULL;
+}
 
-		// Get the article(s)
-		cinja_list arts = art_get(blog_root, nuri);
-		if (!arts)
-			return get_error_response(r, 404);
 
-		if (arts->count == 1) {
-			// If there is only one article, return the article itself
+static void reload_blog()
+{
+	art_root root = art_load(temp_string_create("blog"));
+	if (!root) {
+		fprintf(stderr, "Failed to reload blog.list\n");
+		return;
+	}
+	root->comment_cache_max = comment_cache_size;
+	art_root old = atomic_exchange(&blog_root, root);
+
+	// Wait for the requests that are still using the old root
+	for (int i = 0; i < workers; i++) {
+		while (atomic_load(&hazards[i].root) == old)
+			usleep(1000);
+	}
+	art_free(old);
+}
+
+
+static void reload_templates()
+{
+	templates t = load_templates();
+	if (!t) {
+		fprintf(stderr, "Failed to reload templates\n");
+		return;
+	}
+	templates old = atomic_exchange(&site_temps, t);
+
+	// Wait for the requests that are still using the old templates
+	for (int i = 0; i < workers; i++) {
+		while (atomic_load(&hazards[i].temps) == old)
+			usleep(1000);
+	}
+	free_templates(old);
+}
+
+
+#ifdef __linux__
+static void *watch_files(void *arg)
+{
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0)
+		RETURN_ERROR(NULL, "Failed to watch for changes");
+	// Watch the directories, as editors tend to replace files
+	int blog_wd = inotify_add_watch(fd, "."         , IN_CLOSE_WRITE | IN_MOVED_TO);
+	int temp_wd = inotify_add_watch(fd, TEMPLATE_DIR, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (blog_wd < 0 || temp_wd < 0) {
+		close(fd);
+		RETURN_ERROR(NULL, "Failed to watch for changes");
+	}
+	temp_alloc_push(1 << 20);
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (1) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		int blog_changed = 0, temps_changed = 0;
+		for (char *p = buf; p < buf + n; ) {
+			struct inotify_event *e = (struct inotify_event *)p;
+			if (e->len > 0) {
+				size_t l = strlen(e->name);
+				if (e->wd == blog_wd && strcmp(e->name, "blog.list") == 0)
+					blog_changed = 1;
+				else if (e->wd == temp_wd && l > 5 && strcmp(e->name + l - 5, ".html") == 0)
+					temps_changed = 1;
+			}
+			p += sizeof(*e) + e->len;
+		}
+		if (blog_changed)
+			reload_blog();
+		if (temps_changed)
+			reload_templates();
+		temp_alloc_reset();
+	}
+	temp_alloc_pop();
+	close(fd);
+	return NULL;
+}
+#endif
+
+
+/**
+Render a blog article or a list of articles.
+
+Rendered pages are kept in page_cache until one of the files they were
+generated from changes.
+*/
+static response get_blog_page(art_root root, const string uri, const char *query, int accepted)
+{
+	response r = response_create();
+	r->flags = RESPONSE_USE_TEMPLATE;
+
+	// Get the page to show if a list is requested
+	size_t page = 1, limit = page_size;
+	if (query != NULL && *query != 0) {
+		cinja_dict q = parse_query(query);
+		string v;
+		v = cinja_dict_get(q, temp_string_create("page")).value;
+		if (v != NULL && atoi(v->buf) > 1)
+			page = atoi(v->buf);
+		v = cinja_dict_get(q, temp_string_create("limit")).value;
+		if (v != NULL && atoi(v->buf) > 0)
+			limit = atoi(v->buf) < MAX_PAGE_SIZE ? atoi(v->buf) : MAX_PAGE_SIZE;
+	}
+
+	// Check if the page is cached
+	string key = uri;
+	if (page != 1 || limit != page_size) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "?page=%zu&limit=%zu", page, limit);
+		string components[2] = { uri, temp_string_create(buf) };
+		key = temp_string_concat(components, 2);
+	}
+	const struct encoding *gzip = &encodings[1];
+	string gzkey = encoded_key(key, gzip);
+	cache_entry e;
+	if (accepted & RESPONSE_GZIP) {
+		e = cache_get(page_cache, gzkey);
+		if (e != NULL)
+			return serve_entry(r, page_cache, e, gzkey);
+	}
+	e = cache_get(page_cache, key);
+	if (e != NULL) {
+		// Compress the cached page once for all following requests
+		string gz = accepted & RESPONSE_GZIP ? gzip_parts(&e->body, 1) : NULL;
+		cache_entry ge = gz == NULL ? NULL :
+			cache_put(page_cache, gzkey, &gz, 1, NULL, RESPONSE_GZIP, e->deps, e->dep_count);
+		if (ge != NULL) {
+			cache_release(page_cache, e);
+			return serve_entry(r, page_cache, ge, gzkey);
+		}
+		return serve_entry(r, page_cache, e, key);
+	}
+
+	// Cut the "blog" part of the uri
+	const string nuri = temp_string_create(uri->buf + (uri->buf[4] == '/' ? 5 : 4));
+
+	// Get the article(s)
+	article *arts;
+	TRACE_BEGIN(art_get);
+	ssize_t  count = art_get(root, nuri, &arts);
+	TRACE_END(art_get);
+	if (count < 0)
+		return get_error_response(r, 404);
+
+	// Stat the files the page depends on before they are read
+	struct cache_dep deps[8];
+	size_t dep_count = 0;
+	static const char *templates[] = { MAIN_TEMP, ARTICLE_TEMP, ENTRY_TEMP, COMMENT_TEMP };
+	add_page_dep(deps, &dep_count, temp_string_create("blog.list"));
+	for (size_t i = 0; i < sizeof(templates) / sizeof(*templates); i++)
+		add_page_dep(deps, &dep_count, temp_string_create(templates[i]));
+
+	if (count == 1) {
+		// If there is only one article, return the article itself
+		cinja_dict d = cinja_temp_dict_create();
+		article    a = arts[0];
+		add_page_dep(deps, &dep_count, a->file);
+		add_page_dep(deps, &dep_count, art_comment_path(root, a->uri));
+		if (set_article_dict(d, a, 1) < 0)
+			return get_error_response(r, 500);
+		if (a->prev != NULL) {
+			cinja_dict_set(d, temp_string_create("PREV_URI"  ), a->prev->uri  );
+			cinja_dict_set(d, temp_string_create("PREV_TITLE"), a->prev->title);
+		}
+		if (a->next != NULL) {
+			cinja_dict_set(d, temp_string_create("NEXT_URI"  ), a->next->uri  );
+			cinja_dict_set(d, temp_string_create("NEXT_TITLE"), a->next->title);
+		}
+		TRACE_BEGIN(comments);
+		cinja_list comments = get_comments(root, a->uri);
+		TRACE_END(comments);
+		cinja_dict_set(d, temp_string_create("COMMENTS"), comments);
+		cinja_dict_set(d, temp_string_create("comment" ), temps->comment);
+		TRACE_BEGIN(render_article);
+		r->body  = cinja_temp_render(temps->article, d);
+		TRACE_END(render_article);
+	} else {
+		// Return a page of the list of articles, newest first. The page is
+		// checked before it is multiplied so it can't overflow.
+		if (page > 1 && page - 1 >= ((size_t)count + limit - 1) / limit)
+			return get_error_response(r, 404);
+		size_t start = (page - 1) * limit;
+		size_t end = start + limit < count ? start + limit : count;
+		cinja_list dicts = cinja_temp_list_create();
+		for (size_t i = start; i < end; i++) {
 			cinja_dict d = cinja_temp_dict_create();
-			article    a = cinja_list_get(arts, 0).item;
-			if (set_article_dict(d, a, 1) < 0)
+			// arts is sorted oldest first
+			article    c = arts[count - 1 - i];
+			if (set_article_dict(d, c, 0) < 0)
 				return get_error_response(r, 500);
-			if (a->prev != NULL) {
-				cinja_dict_set(d, temp_string_create("PREV_URI"  ), a->prev->uri  );
-				cinja_dict_set(d, temp_string_create("PREV_TITLE"), a->prev->title);
-			}
-			if (a->next != NULL) {
-				cinja_dict_set(d, temp_string_create("NEXT_URI"  ), a->next->uri  );
-				cinja_dict_set(d, temp_string_create("NEXT_TITLE"), a->next->title);
-			}
-			cinja_list comments = get_comments(blog_root, nuri);
-			cinja_dict_set(d, temp_string_create("COMMENTS"), comments);
-			cinja_dict_set(d, temp_string_create("comment" ), comment_temp);
-			r->body  = cinja_temp_render(art_temp, d);
-		} else {
-			// Return the list of articles
-			cinja_list dicts = cinja_temp_list_create();
-			for (size_t i = 0; i < arts->count; i++) {
-				cinja_dict d = cinja_temp_dict_create();
-				article    c = cinja_list_get(arts, i).item;
-				if (set_article_dict(d, c, 0) < 0)
-					return get_error_response(r, 500);
-				cinja_list_add(dicts, d);
-			}
-			cinja_dict dict = cinja_temp_dict_create();
-			cinja_temp_dict_set(dict, temp_string_create("ARTICLES"), dicts);
-			r->body = cinja_temp_render(entry_temp, dict);
+			cinja_list_add(dicts, d);
 		}
-		r->status = 200;
-		return r;
+		cinja_dict dict = cinja_temp_dict_create();
+		cinja_temp_dict_set(dict, temp_string_create("ARTICLES"), dicts);
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%zu", page);
+		cinja_temp_dict_set(dict, temp_string_create("PAGE"), temp_string_create(buf));
+		// The links to other pages keep the limit
+		snprintf(buf, sizeof(buf), "%zu", limit);
+		cinja_temp_dict_set(dict, temp_string_create("LIMIT"), temp_string_create(buf));
+		if (page > 1) {
+			snprintf(buf, sizeof(buf), "%zu", page - 1);
+			cinja_temp_dict_set(dict, temp_string_create("PREV_PAGE"), temp_string_create(buf));
+		}
+		if (end < count) {
+			snprintf(buf, sizeof(buf), "%zu", page + 1);
+			cinja_temp_dict_set(dict, temp_string_create("NEXT_PAGE"), temp_string_create(buf));
+		}
+		TRACE_BEGIN(render_list);
+		r->body = cinja_temp_render(temps->entry, dict);
+		TRACE_END(render_list);
+	}
+	if (!r->body || wrap_response(r) < 0)
+		return get_error_response(r, 500);
+	set_validators(r, key, deps, dep_count);
+
+	string parts[3] = { r->head, r->body, r->tail };
+	string *p = r->head ? parts : &r->body;
+	size_t  n = r->head ? 3 : 1;
+	TRACE_BEGIN(cache_page);
+	e = cache_put(page_cache, key, p, n, NULL, r->flags, deps, dep_count);
+	TRACE_END(cache_page);
+	if (e != NULL)
+		cache_release(page_cache, e);
+	r->status = 200;
+
+	// Compress the page if the client accepts it
+	string gz = accepted & RESPONSE_GZIP ? gzip_parts(p, n) : NULL;
+	if (gz != NULL) {
+		e = cache_put(page_cache, gzkey, &gz, 1, NULL, RESPONSE_GZIP, deps, dep_count);
+		if (e != NULL)
+			cache_release(page_cache, e);
+		set_validators(r, gzkey, deps, dep_count);
+		r->body  = gz;
+		r->head  = NULL;
+		r->tail  = NULL;
+		r->flags = RESPONSE_GZIP;
+	}
+	return r;
+}
+
+
+static response handle_get(art_root root, const string uri, const char *query, int accepted,
+                           int head)
+{
+	// Check if a blog post is requested
+	response r;
+	if (strncmp("blog", uri->buf, 4) == 0 && (uri->buf[4] == '/' || uri->buf[4] == 0)) {
+		r = get_blog_page(root, uri, query, accepted);
 	} else {
-		return get_static_file(uri);
+		r = get_static_file(uri, accepted, head);
+		// Parts of pages can't be requested as they are wrapped
+		if (r->status == 200 && !(r->flags & RESPONSE_USE_TEMPLATE))
+			cinja_dict_set(r->headers, temp_string_create("Accept-Ranges"), temp_string_create("bytes"));
+	}
+
+	if (r->status == 200)
+		cinja_dict_set(r->headers, temp_string_create("Vary"), temp_string_create("Accept-Encoding"));
+	for (size_t i = 0; i < sizeof(encodings) / sizeof(*encodings); i++) {
+		if (r->flags & encodings[i].flag)
+			cinja_dict_set(r->headers, temp_string_create("Content-Encoding"),
+			               temp_string_create(encodings[i].name));
 	}
+	return r;
 }
 
 
-int main()
+/**
+Write a part of a file to the client. Without a proxy the file is sent with
+sendfile. Otherwise it is read in chunks. A mapping isn't used because it would
+raise SIGBUS if the file were truncated while it is being sent.
+*/
+static void write_file(request req, int fd, off_t offset, size_t length)
 {
-	// Setup
-	temp_alloc_push(1 << 27);
-	if (setup() < 0)
-		return 1;
-	temp_alloc_reset();
+	if (req->http != NULL && http_sendfile(req->http, fd, offset, length) == 0) {
+		req->bytes += length;
+		return;
+	}
+	const size_t chunk = 1 << 18;
+	char *buf = temp_alloc(chunk);
+	if (buf == NULL)
+		RETURN_ERROR(, "Failed to allocate a buffer for a file");
+	while (length > 0) {
+		ssize_t n = pread(fd, buf, length < chunk ? length : chunk, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			RETURN_ERROR(, "Failed to read file");
+		// The file shrank, so the response is cut short
+		if (n == 0)
+			return;
+		req_write(req, buf, n);
+		// Large writes are sent from the buffer itself
+		req_flush(req);
+		offset += n;
+		length -= n;
+	}
+}
 
-	// Loop
-	while (FCGI_Accept() >= 0) {
-
-		// Do not remove this header
-		printf("X-My-Own-Header: All hail the mighty Duck God\r\n");
-
-		// Get the request/FCGI variables
-		const char *path_info  = getenv("PATH_INFO");
-		const char *method = getenv("REQUEST_METHOD");
-		if (!path_info || !method)
-			RETURN_ERROR(1, "%s is not defined\n", !path_info ? "PATH_INFO" : "REQUEST_METHOD");
-
-		// Redirect to HTTPS, if applicable
-		if (redirect_tls) {
-			const char *https = getenv("HTTPS");
-			if (!https || strcmp(https, "on") != 0)
-			{
-				const char *host = getenv("HTTP_HOST");
-				printf("Status: 301\r\n"
-				       "Location: https://%s%s\r\n"
-				       "\r\n"
-				       "<a href=\"https://%s%s\">Click here to go to the secure page</a>",
-				       host, path_info, host, path_info);
-				continue;
-			}
+
+/**
+Ranges
+
+Only the parts of the body that are requested are written. A body sent from a
+file is read range by range, so the rest of the file is never read.
+*/
+
+#define MAX_RANGES 16
+
+struct range {
+	size_t start;
+	size_t end;
+};
+
+
+static size_t body_length(response r)
+{
+	if (r->fd >= 0)
+		return r->length;
+	return (r->head ? r->head->len : 0) + r->body->len + (r->tail ? r->tail->len : 0);
+}
+
+
+/**
+Parse a Range header.
+
+Returns: the amount of ranges, 0 if the header should be ignored or -1 if none
+of the ranges can be satisfied.
+*/
+static int parse_ranges(const char *header, size_t size, struct range *ranges)
+{
+	if (strncmp(header, "bytes=", 6) != 0)
+		return 0;
+	const char *p = header + 6;
+	int count = 0;
+	while (*p != 0) {
+		while (*p == ' ' || *p == ',')
+			p++;
+		if (*p == 0)
+			break;
+		char *end;
+		size_t start, last;
+		if (*p == '-') {
+			// The last n bytes
+			size_t n = strtoull(p + 1, &end, 10);
+			if (end == p + 1)
+				return 0;
+			if (n == 0)
+				goto next;
+			start = n < size ? size - n : 0;
+			last  = size - 1;
+		} else {
+			start = strtoull(p, &end, 10);
+			if (end == p || *end != '-')
+				return 0;
+			p = end + 1;
+			last = strtoull(p, &end, 10);
+			if (end == p)
+				last = size - 1;
+			else if (last < start)
+				return 0;
+			if (last >= size)
+				last = size - 1;
+		}
+		if (start < size) {
+			// Too many ranges are likely an attack, so send everything instead
+			if (count == MAX_RANGES)
+				return 0;
+			ranges[count].start = start;
+			ranges[count].end   = last + 1;
+			count++;
+		}
+	next:
+		p = end;
+		while (*p == ' ')
+			p++;
+		if (*p != 0 && *p != ',')
+			return 0;
+	}
+	return count > 0 ? count : -1;
+}
+
+
+/**
+Write a part of the body of a response.
+*/
+static void write_body(request req, response r, size_t start, size_t end)
+{
+	if (r->fd >= 0) {
+		write_file(req, r->fd, r->offset + start, end - start);
+		return;
+	}
+	string parts[3] = { r->head, r->body, r->tail };
+	for (size_t i = 0, offset = 0; i < 3; i++) {
+		if (parts[i] == NULL)
+			continue;
+		size_t s = start > offset ? start - offset : 0;
+		size_t e = end - offset < parts[i]->len ? end - offset : parts[i]->len;
+		if (end > offset && s < e)
+			req_write(req, parts[i]->buf + s, e - s);
+		offset += parts[i]->len;
+	}
+}
+
+
+static void write_headers(request req, response r)
+{
+	void *state = NULL;
+	req_printf(req, "Status: %d\r\n", r->status);
+	for (cinja_dict_entry_t e = cinja_dict_iter(r->headers, &state); e.value != NULL; e = cinja_dict_iter(r->headers, &state))
+		req_printf(req, "%s: %s\r\n", e.key->buf, ((string)e.value)->buf);
+	req_write(req, "\r\n", 2);
+}
+
+
+/**
+Write the response to the client. If ranges are requested and the response
+allows it, only those ranges are written.
+*/
+static void write_response(request req, response r, int head)
+{
+	size_t size = body_length(r);
+	struct range ranges[MAX_RANGES];
+	int count = 0;
+
+	const char *range = req_getenv(req, "HTTP_RANGE");
+	if (range != NULL && r->status == 200 &&
+	    cinja_dict_get(r->headers, temp_string_create("Accept-Ranges")).value != NULL) {
+		// Only use the ranges if the client's copy is still the same
+		const char *if_range = req_getenv(req, "HTTP_IF_RANGE");
+		string etag = cinja_dict_get(r->headers, temp_string_create("ETag")).value;
+		string date = cinja_dict_get(r->headers, temp_string_create("Last-Modified")).value;
+		if (if_range == NULL || (etag && strcmp(if_range, etag->buf) == 0) ||
+		    (date && strcmp(if_range, date->buf) == 0))
+			count = parse_ranges(range, size, ranges);
+	}
+
+	char buf[128];
+	if (count < 0) {
+		r->status = 416;
+		snprintf(buf, sizeof(buf), "bytes */%lu", size);
+		cinja_dict_set(r->headers, temp_string_create("Content-Range"), temp_string_create(buf));
+		cinja_dict_set(r->headers, temp_string_create("Content-Length"), temp_string_create("0"));
+		write_headers(req, r);
+		return;
+	}
+
+	if (count == 0) {
+		snprintf(buf, sizeof(buf), "%lu", size);
+		cinja_dict_set(r->headers, temp_string_create("Content-Length"), temp_string_create(buf));
+		write_headers(req, r);
+		if (!head)
+			write_body(req, r, 0, size);
+		return;
+	}
+
+	r->status = 206;
+	if (count == 1) {
+		snprintf(buf, sizeof(buf), "bytes %lu-%lu/%lu", ranges[0].start, ranges[0].end - 1, size);
+		cinja_dict_set(r->headers, temp_string_create("Content-Range"), temp_string_create(buf));
+		snprintf(buf, sizeof(buf), "%lu", ranges[0].end - ranges[0].start);
+		cinja_dict_set(r->headers, temp_string_create("Content-Length"), temp_string_create(buf));
+		write_headers(req, r);
+		if (!head)
+			write_body(req, r, ranges[0].start, ranges[0].end);
+		return;
+	}
+
+	// Send the ranges as a multipart body. The length of the body has to be
+	// known up front, so the part headers are formatted twice.
+	string mime = cinja_dict_get(r->headers, temp_string_create("Content-Type")).value;
+	const char *type = mime ? mime->buf : "application/octet-stream";
+	const char *boundary = "soup-byteranges-7f3a9c";
+	size_t length = 0;
+	for (int i = 0; i < count; i++) {
+		length += snprintf(buf, sizeof(buf), "\r\n--%s\r\nContent-Type: %s\r\n"
+		                   "Content-Range: bytes %lu-%lu/%lu\r\n\r\n", boundary, type,
+		                   ranges[i].start, ranges[i].end - 1, size);
+		length += ranges[i].end - ranges[i].start;
+	}
+	length += snprintf(buf, sizeof(buf), "\r\n--%s--\r\n", boundary);
+
+	snprintf(buf, sizeof(buf), "multipart/byteranges; boundary=%s", boundary);
+	cinja_dict_set(r->headers, temp_string_create("Content-Type"), temp_string_create(buf));
+	snprintf(buf, sizeof(buf), "%lu", length);
+	cinja_dict_set(r->headers, temp_string_create("Content-Length"), temp_string_create(buf));
+	write_headers(req, r);
+	if (head)
+		return;
+	for (int i = 0; i < count; i++) {
+		req_printf(req, "\r\n--%s\r\nContent-Type: %s\r\n"
+		           "Content-Range: bytes %lu-%lu/%lu\r\n\r\n", boundary, type,
+		           ranges[i].start, ranges[i].end - 1, size);
+		write_body(req, r, ranges[i].start, ranges[i].end);
+	}
+	req_printf(req, "\r\n--%s--\r\n", boundary);
+}
+
+
+/**
+Metrics
+
+Each request is counted by its method, the kind of page it asked for and its
+status. The metrics themselves are served at metrics_path, but only to the
+addresses in metrics_allow.
+*/
+
+static enum metrics_method method_of(const char *method)
+{
+	if (method == NULL)
+		return METRICS_OTHER_METHOD;
+	if (strcmp(method, "GET") == 0)
+		return METRICS_GET;
+	if (strcmp(method, "HEAD") == 0)
+		return METRICS_HEAD;
+	if (strcmp(method, "POST") == 0)
+		return METRICS_POST;
+	return METRICS_OTHER_METHOD;
+}
+
+
+static enum metrics_route route_of(const char *method, const string uri)
+{
+	if (strcmp(method, "POST") == 0)
+		return METRICS_POST_COMMENT;
+	if (strncmp("blog", uri->buf, 4) != 0 || (uri->buf[4] != '/' && uri->buf[4] != 0))
+		return METRICS_STATIC;
+	// Lists are selected by date, just like in art_get
+	char c = uri->buf[4] == '/' ? uri->buf[5] : 0;
+	return c == 0 || ('0' <= c && c <= '9') ? METRICS_LIST : METRICS_ARTICLE;
+}
+
+
+static int metrics_allowed(const char *addr)
+{
+	if (addr == NULL)
+		return 0;
+	size_t len = strlen(addr);
+	for (const char *p = metrics_allow; *p != 0; ) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		size_t l = strcspn(p, " \t");
+		if (l == len && strncmp(p, addr, l) == 0)
+			return 1;
+		p += l;
+	}
+	return 0;
+}
+
+
+static void write_metrics(request req, int head)
+{
+	size_t len;
+	char *buf = metrics_render(&len);
+	if (buf == NULL) {
+		req->status = 500;
+		req_printf(req, "Status: 500\r\n\r\n");
+		return;
+	}
+	req->status = 200;
+	req_printf(req, "Status: 200\r\n"
+	                "Content-Type: text/plain; version=0.0.4\r\n"
+	                "Content-Length: %lu\r\n"
+	                "Cache-Control: no-store\r\n"
+	                "\r\n", len);
+	if (!head)
+		req_write(req, buf, len);
+	// Large writes aren't copied
+	req_flush(req);
+	free(buf);
+}
+
+
+/**
+Release what a response holds once it has been sent. The head and tail belong
+to the templates and the body may belong to a cache entry, so they can only be
+released now.
+*/
+static void finish_response(response r)
+{
+	release();
+	if (r->fd >= 0)
+		close(r->fd);
+	if (r->entry != NULL)
+		cache_release(r->cache, r->entry);
+}
+
+
+static void handle_request(request req)
+{
+	// Do not remove this header
+	req_printf(req, "X-My-Own-Header: All hail the mighty Duck God\r\n");
+
+	// Get the request/FCGI variables
+	const char *path_info  = req_getenv(req, "PATH_INFO");
+	const char *method = req_getenv(req, "REQUEST_METHOD");
+	if (!path_info || !method)
+		RETURN_ERROR(, "%s is not defined\n", !path_info ? "PATH_INFO" : "REQUEST_METHOD");
+
+	// Redirect to HTTPS, if applicable
+	if (redirect_tls) {
+		const char *https = req_getenv(req, "HTTPS");
+		if (!https || strcmp(https, "on") != 0)
+		{
+			const char *host = req_getenv(req, "HTTP_HOST");
+			req_printf(req, "Status: 301\r\n"
+			                "Location: https://%s%s\r\n"
+			                "\r\n"
+			                "<a href=\"https://%s%s\">Click here to go to the secure page</a>",
+			                host, path_info, host, path_info);
+			req->status = 301;
+			return;
 		}
+	}
+
+	// Convert path_info to a string.
+	if (path_info[0] == '/')
+		path_info++;
+	size_t path_info_l = strlen(path_info);
+	if (path_info_l > 0 && path_info[path_info_l - 1] == '/')
+		path_info_l--;
+	string uri = temp_string_create(path_info, path_info_l);
+	int head = strcmp(method, "HEAD") == 0;
+	req->route = route_of(method, uri);
+
+	// To anyone else the metrics look like any other missing page
+	if (metrics_path != NULL && strcmp(uri->buf, metrics_path) == 0 &&
+	    (head || strcmp(method, "GET") == 0) && metrics_allowed(req_getenv(req, "REMOTE_ADDR"))) {
+		req->route = METRICS_OTHER_ROUTE;
+		write_metrics(req, head);
+		return;
+	}
+
+	// Parse the request
+	response r;
+	art_root root = acquire();
+	TRACE_BEGIN(handle);
+	if (head || strcmp(method, "GET") == 0)
+		r = handle_get(root, uri, req_getenv(req, "QUERY_STRING"),
+		               accepted_encodings(req_getenv(req, "HTTP_ACCEPT_ENCODING")), head);
+	else if (strcmp(method, "POST") == 0)
+		r = handle_post(req, root, uri);
+	else
+		r = get_error_response(response_create(), 501);
+	TRACE_END(handle);
+
+	// Let the client use its own copy if it is still valid
+	if ((head || strcmp(method, "GET") == 0) && is_not_modified(req, r)) {
+		req->status = 304;
+		req->cached = r->entry != NULL;
+		req_printf(req, "Status: 304\r\n");
+		string etag = cinja_dict_get(r->headers, temp_string_create("ETag")).value;
+		string date = cinja_dict_get(r->headers, temp_string_create("Last-Modified")).value;
+		req_printf(req, "ETag: %s\r\nLast-Modified: %s\r\n\r\n", etag->buf, date->buf);
+		finish_response(r);
+		return;
+	}
+
+	// Check if the response should be wrapped in the base template
+	if (wrap_response(r) < 0) {
+		req->status = 500;
+		req_printf(req, "Status: 500\r\n\r\nError during rendering");
+		finish_response(r);
+		return;
+	}
 
-		// Convert path_info to a string.
-		if (path_info[0] == '/')
-			path_info++;
-		size_t path_info_l = strlen(path_info);
-		if (path_info_l > 0 && path_info[path_info_l - 1] == '/')
-			path_info_l--;
-		string uri = temp_string_create(path_info, path_info_l);
-
-		// Parse the request
-		response r;
-		if (strcmp(method, "GET") == 0)
-			r = handle_get(uri);
-		else if (strcmp(method, "POST") == 0)
-			r = handle_post(uri);
+	// Pass the headers and body to the proxy
+	TRACE_BEGIN(write);
+	write_response(req, r, head);
+	req_flush(req);
+	TRACE_END(write);
+	req->status = r->status;
+	req->cached = r->entry != NULL;
+	finish_response(r);
+}
+
+
+/**
+Handle the requests read by the event loop until the server shuts down.
+
+Each worker has its own temporary allocator arena, so the arena has to be
+pushed by the thread that uses it.
+*/
+static void *worker(void *arg)
+{
+	worker_id = (intptr_t)arg;
+	metrics_thread(worker_id);
+	accesslog_thread(worker_id);
+	temp_alloc_push(arena_size);
+	while (1) {
+		struct request req = { NULL };
+		if (http_srv != NULL)
+			req.http = http_accept(http_srv);
+		else
+			req.fcgi = fcgi_accept(fcgi_srv);
+		if (req.http == NULL && req.fcgi == NULL)
+			break;
+
+		// The arena is a bump allocator, so the distance between allocations
+		// made before and after the request is what the request took from it
+		char *mark = temp_alloc(1);
+		uint64_t start = metrics_now();
+		req.route = METRICS_OTHER_ROUTE;
+		TRACE_BEGIN(request);
+		handle_request(&req);
+		TRACE_END(request);
+		char *end = temp_alloc(1);
+		uint64_t ns = metrics_now() - start;
+		const char *method = req_getenv(&req, "REQUEST_METHOD");
+		metrics_request(method_of(method), req.route, req.status, ns,
+		                mark != NULL && end > mark ? end - mark : 0);
+		accesslog_request(method, req_getenv(&req, "PATH_INFO"), req_getenv(&req, "QUERY_STRING"),
+		                  req.status, req.bytes, ns, req.cached);
+		if (req.http != NULL)
+			http_finish(req.http);
 		else
-			r = get_error_response(response_create(), 501);
+			fcgi_finish(req.fcgi);
+		temp_alloc_reset();
+	}
+	temp_alloc_pop();
+	return NULL;
+}
 
-		// Convert the status integer to a string
-		char status_str[64];
-		snprintf(status_str, sizeof(status_str), "%d", r->status);
 
-		// Check if the response should be wrapped in the base template
-		if (r->flags & RESPONSE_USE_TEMPLATE) {
-			cinja_dict d = cinja_temp_dict_create();
-			cinja_dict_set(d, temp_string_create("BODY"), r->body);
-			r->body = cinja_temp_render(main_temp, d);
-			if (!r->body) {
-				printf("Status: 500\r\nError during rendering");
+/**
+Run the event loop and the worker threads until the server shuts down. The
+calling thread is a worker too.
+*/
+static void serve()
+{
+#ifdef SOUP_TRACE
+	if (trace_start_dumper() < 0)
+		perror("Failed to start the trace dumper");
+#endif
+	// The writer thread doesn't survive a fork, so every process starts its own
+	if (access_log != NULL &&
+	    accesslog_open(access_log, access_log_size, access_log_files, workers) < 0)
+		perror("Failed to open the access log");
+
+	pthread_t loop;
+	if (listen_addr != NULL) {
+		http_srv = http_create(listen_fd);
+		if (http_srv == NULL)
+			RETURN_ERROR(, "Failed to create HTTP server");
+		if (pthread_create(&loop, NULL, http_run, http_srv) != 0)
+			RETURN_ERROR(, "Failed to create event loop");
+	} else {
+		fcgi_srv = fcgi_create(listen_fd);
+		if (fcgi_srv == NULL)
+			RETURN_ERROR(, "Failed to create FastCGI server");
+		if (pthread_create(&loop, NULL, fcgi_run, fcgi_srv) != 0)
+			RETURN_ERROR(, "Failed to create event loop");
+	}
+	pthread_detach(loop);
+
+#ifdef __linux__
+	pthread_t watcher;
+	if (pthread_create(&watcher, NULL, watch_files, NULL) == 0)
+		pthread_detach(watcher);
+	else
+		perror("Failed to create watcher");
+#endif
+
+	pthread_t *threads = malloc((workers - 1) * sizeof(*threads));
+	int n;
+	for (n = 0; n < workers - 1; n++) {
+		if (pthread_create(&threads[n], NULL, worker, (void *)(intptr_t)(n + 1)) != 0) {
+			perror("Failed to create worker");
+			break;
+		}
+	}
+	worker((void *)0);
+	for (int i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	accesslog_close();
+}
+
+
+/**
+Prefork
+
+The parent only forks and reaps processes. Everything loaded by setup() is
+shared copy-on-write with the children, which all accept on the listening
+socket they inherited from the parent.
+*/
+
+static void on_terminate(int sig)
+{
+	terminate = 1;
+}
+
+
+static pid_t spawn()
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT , SIG_DFL);
+		serve();
+		exit(0);
+	}
+	if (pid < 0)
+		perror("Failed to fork");
+	return pid;
+}
+
+
+static void supervise()
+{
+	struct sigaction sa = { .sa_handler = on_terminate };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT , &sa, NULL);
+
+	pid_t  *children = malloc(prefork * sizeof(*children));
+	time_t *started  = malloc(prefork * sizeof(*started));
+	for (int i = 0; i < prefork; i++) {
+		children[i] = spawn();
+		started[i]  = time(NULL);
+	}
+
+	while (!terminate) {
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0) {
+			if (errno == EINTR)
 				continue;
-			}
+			break;
 		}
+		for (int i = 0; i < prefork; i++) {
+			if (children[i] != pid)
+				continue;
+			if (WIFSIGNALED(status))
+				fprintf(stderr, "Worker %d killed by signal %d\n", pid, WTERMSIG(status));
+			else
+				fprintf(stderr, "Worker %d exited with status %d\n", pid, WEXITSTATUS(status));
+			// Don't spin if the worker dies right away
+			if (time(NULL) - started[i] < 1)
+				sleep(1);
+			children[i] = spawn();
+			started[i]  = time(NULL);
+		}
+	}
+
+	for (int i = 0; i < prefork; i++) {
+		if (children[i] > 0)
+			kill(children[i], SIGTERM);
+	}
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	free(children);
+	free(started);
+}
 
-		// Pass the headers and body to the proxy
-		void *state = NULL;
-		printf("Status: %d\r\n", r->status);
-		for (cinja_dict_entry_t e = cinja_dict_iter(r->headers, &state); e.value != NULL; e = cinja_dict_iter(r->headers, &state))
-			printf("%s: %s\r\n", e.key->buf, ((string)e.value)->buf);
-		printf("\r\n%s", r->body->buf);
 
-		// Cleanup
+int main(int argc, char **argv)
+{
+	// Convert old comment files if asked to
+	if (argc > 1 && strcmp(argv[1], "migrate-comments") == 0) {
+		temp_alloc_push(1 << 27);
+		art_root root = art_load(temp_string_create("blog"));
+		if (!root)
+			RETURN_ERROR(1, "Failed to load blog.list");
+		int ret = art_migrate_comments(root);
+		if (ret < 0)
+			perror("Failed to migrate comments");
+		art_free(root);
+		temp_alloc_pop();
+		return ret < 0 ? 1 : 0;
+	}
+
+	// Setup
+	temp_alloc_push(1 << 27);
+	if (setup() < 0)
+		return 1;
+	temp_alloc_reset();
+
+	// Without a proxy, the server listens on a socket of its own. Otherwise
+	// the web server passes a listening socket if it speaks FastCGI.
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (listen_addr == NULL && getpeername(listen_fd, (struct sockaddr *)&addr, &len) < 0 &&
+	    errno != ENOTCONN) {
+		// Handle a single request
+		struct request req = { NULL };
+		handle_request(&req);
 		fflush(stdout);
-		temp_alloc_reset();
+	} else {
+		if (listen_addr != NULL && (listen_fd = http_listen(listen_addr)) < 0)
+			RETURN_ERROR(1, "Failed to listen on %s", listen_addr);
+		if (prefork > 0)
+			supervise();
+		else
+			serve();
 	}
 
 	temp_alloc_pop();
-	art_free(blog_root);
+	cache_free(static_cache);
+	cache_free(  page_cache);
+	art_free(atomic_load(&blog_root));
+	free(hazards);
 	// Goddamnit Valgrind
-	cinja_free(   main_temp);
-	cinja_free(  error_temp);
-	cinja_free(    art_temp);
-	cinja_free(  entry_temp);
-	cinja_free(comment_temp);
+	free_templates(atomic_load(&site_temps));
 	return 0;
 }
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include "../include/metrics.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define SUB_BITS    2
+#define SUB_BUCKETS (1 << SUB_BITS)
+// Latencies of up to 2^MAX_OCTAVE microseconds (about a minute) get a bucket
+#define MAX_OCTAVE  26
+#define BUCKETS     ((MAX_OCTAVE - SUB_BITS + 1) * SUB_BUCKETS)
+#define MAX_CACHES  4
+
+static const int statuses[] = {
+	200, 204, 206, 301, 302, 304, 400, 403, 404, 405, 413, 416, 500, 501, 503,
+};
+#define STATUSES (sizeof(statuses) / sizeof(*statuses))
+
+static const char *method_names[METRICS_METHODS] = { "GET", "HEAD", "POST", "other" };
+static const char *route_names[METRICS_ROUTES] = {
+	"static", "article", "list", "post", "other",
+};
+
+typedef _Atomic uint64_t counter;
+
+struct histogram {
+	// The last bucket holds everything that is too large for the others
+	counter buckets[BUCKETS + 1];
+	counter sum_ns;
+	counter count;
+};
+
+struct slot {
+	// The last status is for statuses that aren't listed
+	counter requests[METRICS_METHODS][METRICS_ROUTES][STATUSES + 1];
+	struct histogram latency[METRICS_ROUTES];
+	struct histogram comment_write;
+	counter arena_sum;
+	counter arena_max;
+	counter arena_count;
+} __attribute__((aligned(64)));
+
+struct totals {
+	uint64_t buckets[BUCKETS + 1];
+	uint64_t sum_ns;
+	uint64_t count;
+};
+
+
+static struct slot *slots;
+static int          slot_count;
+static __thread struct slot *local;
+
+static struct {
+	const char *name;
+	cache       c;
+} caches[MAX_CACHES];
+static int cache_count;
+
+
+/*
+ * Recording
+ */
+static void add(counter *c, uint64_t v)
+{
+	// Only the owning thread writes to a slot, so a load and a store suffice
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v,
+	                      memory_order_relaxed);
+}
+
+
+static size_t bucket_of(uint64_t us)
+{
+	if (us < SUB_BUCKETS)
+		return us;
+	int e = 63 - __builtin_clzll(us);
+	size_t i = (e - SUB_BITS + 1) * SUB_BUCKETS + (us >> (e - SUB_BITS)) - SUB_BUCKETS;
+	return i < BUCKETS ? i : BUCKETS;
+}
+
+
+/*
+ * The exclusive upper bound of a bucket in microseconds.
+ */
+static uint64_t bucket_bound(size_t i)
+{
+	if (i < SUB_BUCKETS)
+		return i + 1;
+	int e = i / SUB_BUCKETS + SUB_BITS - 1;
+	return (uint64_t)(i % SUB_BUCKETS + SUB_BUCKETS + 1) << (e - SUB_BITS);
+}
+
+
+static void observe(struct histogram *h, uint64_t ns)
+{
+	add(&h->buckets[bucket_of(ns / 1000)], 1);
+	add(&h->sum_ns, ns);
+	add(&h->count, 1);
+}
+
+
+int metrics_init(int n)
+{
+	slots = aligned_alloc(__alignof__(*slots), n * sizeof(*slots));
+	if (slots == NULL)
+		return -1;
+	memset(slots, 0, n * sizeof(*slots));
+	slot_count = n;
+	return 0;
+}
+
+
+void metrics_thread(int id)
+{
+	local = id < slot_count ? &slots[id] : NULL;
+}
+
+
+void metrics_add_cache(const char *name, cache c)
+{
+	if (cache_count < MAX_CACHES) {
+		caches[cache_count].name = name;
+		caches[cache_count].c    = c;
+		cache_count++;
+	}
+}
+
+
+uint64_t metrics_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+void metrics_request(enum metrics_method method, enum metrics_route route, int status,
+                     uint64_t ns, size_t arena)
+{
+	struct slot *s = local;
+	if (s == NULL)
+		return;
+	size_t i = 0;
+	while (i < STATUSES && statuses[i] != status)
+		i++;
+	add(&s->requests[method][route][i], 1);
+	observe(&s->latency[route], ns);
+	add(&s->arena_sum, arena);
+	add(&s->arena_count, 1);
+	if (arena > atomic_load_explicit(&s->arena_max, memory_order_relaxed))
+		atomic_store_explicit(&s->arena_max, arena, memory_order_relaxed);
+}
+
+
+void metrics_comment_write(uint64_t ns)
+{
+	if (local != NULL)
+		observe(&local->comment_write, ns);
+}
+
+
+/*
+ * Rendering
+ */
+static uint64_t load(counter *c)
+{
+	return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+
+static void total(struct totals *t, struct histogram *h)
+{
+	for (size_t i = 0; i <= BUCKETS; i++)
+		t->buckets[i] += load(&h->buckets[i]);
+	t->sum_ns += load(&h->sum_ns);
+	t->count  += load(&h->count);
+}
+
+
+static void print_histogram(FILE *f, const char *name, const char *labels,
+                            const struct totals *t)
+{
+	const char *sep = *labels != 0 ? "," : "";
+	uint64_t n = 0;
+	// Buckets above the slowest request so far would all equal the count
+	for (size_t i = 0; i < BUCKETS && n < t->count; i++) {
+		n += t->buckets[i];
+		fprintf(f, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, labels, sep,
+		        bucket_bound(i) / 1e6, n);
+	}
+	// The slots are read while they are being written to
+	n = t->count > n ? t->count : n;
+	fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, sep, n);
+	if (*labels != 0) {
+		fprintf(f, "%s_sum{%s} %.6f\n", name, labels, t->sum_ns / 1e9);
+		fprintf(f, "%s_count{%s} %" PRIu64 "\n", name, labels, n);
+	} else {
+		fprintf(f, "%s_sum %.6f\n", name, t->sum_ns / 1e9);
+		fprintf(f, "%s_count %" PRIu64 "\n", name, n);
+	}
+}
+
+
+char *metrics_render(size_t *len)
+{
+	char *buf = NULL;
+	FILE *f = open_memstream(&buf, len);
+	if (f == NULL)
+		return NULL;
+
+	fputs("# HELP soup_requests_total Requests handled, by method, route and status.\n"
+	      "# TYPE soup_requests_total counter\n", f);
+	for (int m = 0; m < METRICS_METHODS; m++) {
+		for (int r = 0; r < METRICS_ROUTES; r++) {
+			for (size_t s = 0; s <= STATUSES; s++) {
+				uint64_t n = 0;
+				for (int i = 0; i < slot_count; i++)
+					n += load(&slots[i].requests[m][r][s]);
+				if (n == 0)
+					continue;
+				char status[16];
+				if (s < STATUSES)
+					snprintf(status, sizeof(status), "%d", statuses[s]);
+				else
+					strcpy(status, "other");
+				fprintf(f, "soup_requests_total{method=\"%s\",route=\"%s\",status=\"%s\"} %"
+				        PRIu64 "\n", method_names[m], route_names[r], status, n);
+			}
+		}
+	}
+
+	fputs("# HELP soup_request_duration_seconds Time taken to handle a request.\n"
+	      "# TYPE soup_request_duration_seconds histogram\n", f);
+	for (int r = 0; r < METRICS_ROUTES; r++) {
+		struct totals t = { { 0 } };
+		for (int i = 0; i < slot_count; i++)
+			total(&t, &slots[i].latency[r]);
+		char labels[32];
+		snprintf(labels, sizeof(labels), "route=\"%s\"", route_names[r]);
+		print_histogram(f, "soup_request_duration_seconds", labels, &t);
+	}
+
+	fputs("# HELP soup_comment_write_duration_seconds Time a request waited for its comment "
+	      "to be written.\n"
+	      "# TYPE soup_comment_write_duration_seconds histogram\n", f);
+	struct totals t = { { 0 } };
+	for (int i = 0; i < slot_count; i++)
+		total(&t, &slots[i].comment_write);
+	print_histogram(f, "soup_comment_write_duration_seconds", "", &t);
+
+	uint64_t arena_sum = 0, arena_count = 0, arena_max = 0;
+	for (int i = 0; i < slot_count; i++) {
+		arena_sum   += load(&slots[i].arena_sum);
+		arena_count += load(&slots[i].arena_count);
+		uint64_t m   = load(&slots[i].arena_max);
+		arena_max    = m > arena_max ? m : arena_max;
+	}
+	fprintf(f, "# HELP soup_request_arena_bytes Bytes a request took from its worker's arena.\n"
+	           "# TYPE soup_request_arena_bytes summary\n"
+	           "soup_request_arena_bytes_sum %" PRIu64 "\n"
+	           "soup_request_arena_bytes_count %" PRIu64 "\n"
+	           "# HELP soup_request_arena_max_bytes The most bytes a single request took "
+	           "from its worker's arena.\n"
+	           "# TYPE soup_request_arena_max_bytes gauge\n"
+	           "soup_request_arena_max_bytes %" PRIu64 "\n",
+	           arena_sum, arena_count, arena_max);
+
+	fputs("# HELP soup_cache_lookups_total Cache lookups, by whether a fresh entry was found.\n"
+	      "# TYPE soup_cache_lookups_total counter\n", f);
+	struct cache_stats stats[MAX_CACHES];
+	for (int i = 0; i < cache_count; i++) {
+		cache_stats(caches[i].c, &stats[i]);
+		fprintf(f, "soup_cache_lookups_total{cache=\"%s\",result=\"hit\"} %lu\n"
+		           "soup_cache_lookups_total{cache=\"%s\",result=\"miss\"} %lu\n",
+		        caches[i].name, stats[i].hits, caches[i].name, stats[i].misses);
+	}
+	fputs("# HELP soup_cache_entries Entries in a cache.\n"
+	      "# TYPE soup_cache_entries gauge\n", f);
+	for (int i = 0; i < cache_count; i++)
+		fprintf(f, "soup_cache_entries{cache=\"%s\"} %lu\n", caches[i].name, stats[i].count);
+	fputs("# HELP soup_cache_bytes Bytes used by a cache.\n"
+	      "# TYPE soup_cache_bytes gauge\n", f);
+	for (int i = 0; i < cache_count; i++)
+		fprintf(f, "soup_cache_bytes{cache=\"%s\"} %lu\n", caches[i].name, stats[i].size);
+
+	if (fclose(f) != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include "../include/poller.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+# include <pthread.h>
+# include <string.h>
+#endif
+
+
+#ifdef __linux__
+
+/*
+ * epoll
+ */
+#define MAX_EVENTS 64
+
+struct poller {
+	int fd;
+};
+
+
+poller poller_create()
+{
+	struct poller *p = malloc(sizeof(*p));
+	if (p == NULL)
+		return NULL;
+	p->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (p->fd < 0) {
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+
+int poller_add_listener(poller p, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+	if (epoll_ctl(p->fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+		return 0;
+	ev.events = EPOLLIN;
+	return epoll_ctl(p->fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+int poller_add(poller p, int fd, void *ptr, int events)
+{
+	struct epoll_event ev = {
+		.events   = EPOLLET | (events & POLLER_IN  ? EPOLLIN | EPOLLRDHUP : 0)
+		                    | (events & POLLER_OUT ? EPOLLOUT : 0),
+		.data.ptr = ptr,
+	};
+	return epoll_ctl(p->fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+void poller_del(poller p, int fd)
+{
+	epoll_ctl(p->fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+
+void poller_want_write(poller p, int fd, int want)
+{
+	// Edge-triggered events report the socket once it becomes writable again
+}
+
+
+int poller_wait(poller p, struct poller_event *events, int n, int timeout)
+{
+	struct epoll_event ev[MAX_EVENTS];
+	int k = epoll_wait(p->fd, ev, n < MAX_EVENTS ? n : MAX_EVENTS, timeout);
+	for (int i = 0; i < k; i++) {
+		events[i].ptr    = ev[i].data.ptr;
+		events[i].events = (ev[i].events & EPOLLIN  ? POLLER_IN  : 0) |
+		                   (ev[i].events & EPOLLOUT ? POLLER_OUT : 0) |
+		                   (ev[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR) ? POLLER_HUP : 0);
+	}
+	return k;
+}
+
+
+int poller_accept(int listen_fd, struct sockaddr *addr, socklen_t *len)
+{
+	return accept4(listen_fd, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+#else
+
+/*
+ * Fallback
+ *
+ * The sockets are kept in an array indexed by their descriptor, from which
+ * the set for poll(2) is built on every call. Other threads that want to
+ * write to a socket wake the call up through a pipe.
+ */
+struct entry {
+	void *ptr;
+	int   events;
+	int   want_write;
+	int   used;
+};
+
+struct poller {
+	pthread_mutex_t lock;
+	struct entry *entries;
+	int  cap;
+	int  wake[2];
+	// Only used by poller_wait
+	struct pollfd *fds;
+	void **ptrs;
+	int  fds_cap;
+	int  start;
+};
+
+
+static int set_flags(int fd)
+{
+	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+	       fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ? -1 : 0;
+}
+
+
+poller poller_create()
+{
+	struct poller *p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return NULL;
+	if (pipe(p->wake) < 0) {
+		free(p);
+		return NULL;
+	}
+	if (set_flags(p->wake[0]) < 0 || set_flags(p->wake[1]) < 0) {
+		close(p->wake[0]);
+		close(p->wake[1]);
+		free(p);
+		return NULL;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	return p;
+}
+
+
+static int add(poller p, int fd, void *ptr, int events)
+{
+	pthread_mutex_lock(&p->lock);
+	if (fd >= p->cap) {
+		int cap = p->cap > 0 ? p->cap : 64;
+		while (cap <= fd)
+			cap *= 2;
+		struct entry *e = realloc(p->entries, cap * sizeof(*e));
+		if (e == NULL) {
+			pthread_mutex_unlock(&p->lock);
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(e + p->cap, 0, (cap - p->cap) * sizeof(*e));
+		p->entries = e;
+		p->cap     = cap;
+	}
+	p->entries[fd] = (struct entry){ .ptr = ptr, .events = events, .used = 1 };
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+
+int poller_add_listener(poller p, int fd)
+{
+	return add(p, fd, NULL, POLLER_IN);
+}
+
+
+int poller_add(poller p, int fd, void *ptr, int events)
+{
+	return add(p, fd, ptr, events);
+}
+
+
+void poller_del(poller p, int fd)
+{
+	pthread_mutex_lock(&p->lock);
+	if (fd < p->cap)
+		p->entries[fd].used = 0;
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+void poller_want_write(poller p, int fd, int want)
+{
+	pthread_mutex_lock(&p->lock);
+	int wake = 0;
+	if (fd < p->cap && p->entries[fd].used) {
+		wake = want && !p->entries[fd].want_write;
+		p->entries[fd].want_write = want;
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (wake)
+		while (write(p->wake[1], "", 1) < 0 && errno == EINTR)
+			;
+}
+
+
+int poller_wait(poller p, struct poller_event *events, int n, int timeout)
+{
+	// The pipe comes first
+	pthread_mutex_lock(&p->lock);
+	if (p->cap + 1 > p->fds_cap) {
+		struct pollfd *fds  = realloc(p->fds , (p->cap + 1) * sizeof(*fds));
+		if (fds != NULL)
+			p->fds = fds;
+		void         **ptrs = realloc(p->ptrs, (p->cap + 1) * sizeof(*ptrs));
+		if (ptrs != NULL)
+			p->ptrs = ptrs;
+		if (fds == NULL || ptrs == NULL) {
+			pthread_mutex_unlock(&p->lock);
+			errno = ENOMEM;
+			return -1;
+		}
+		p->fds_cap = p->cap + 1;
+	}
+	int count = 1;
+	p->fds[0] = (struct pollfd){ .fd = p->wake[0], .events = POLLIN };
+	for (int fd = 0; fd < p->cap; fd++) {
+		struct entry *e = &p->entries[fd];
+		if (!e->used)
+			continue;
+		short ev = (e->events & POLLER_IN ? POLLIN : 0) |
+		           (e->events & POLLER_OUT && e->want_write ? POLLOUT : 0);
+		p->fds[count]  = (struct pollfd){ .fd = fd, .events = ev };
+		p->ptrs[count] = e->ptr;
+		count++;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	if (poll(p->fds, count, timeout) < 0)
+		return -1;
+	if (p->fds[0].revents != 0) {
+		char buf[64];
+		while (read(p->wake[0], buf, sizeof(buf)) > 0)
+			;
+	}
+
+	// Sockets stay ready until they are read, so any that don't fit are
+	// reported by the next call. Starting at a different socket each time
+	// keeps the last ones from waiting for ever.
+	int k = 0;
+	for (int j = 0; j < count - 1 && k < n; j++) {
+		int i = 1 + (p->start + j) % (count - 1);
+		short re = p->fds[i].revents;
+		if (re == 0)
+			continue;
+		events[k].ptr    = p->ptrs[i];
+		events[k].events = (re & POLLIN  ? POLLER_IN  : 0) |
+		                   (re & POLLOUT ? POLLER_OUT : 0) |
+		                   (re & (POLLHUP | POLLERR | POLLNVAL) ? POLLER_HUP : 0);
+		k++;
+	}
+	p->start++;
+	return k;
+}
+
+
+int poller_accept(int listen_fd, struct sockaddr *addr, socklen_t *len)
+{
+	int fd = accept(listen_fd, addr, len);
+	if (fd < 0)
+		return -1;
+	if (set_flags(fd) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+#ifdef SO_NOSIGPIPE
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+	return fd;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#include "../include/query.h"
+#include <string.h>
+#include "temp-alloc.h"
+#include "temp/dict.h"
+
+
+static int hex_value(char c)
+{
+	if ('0' <= c && c <= '9')
+		return c - '0';
+	if ('A' <= c && c <= 'F')
+		return c - 'A' + 10;
+	if ('a' <= c && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+
+string copy_query_field(const char **pptr, char delim)
+{
+	const char *ptr = *pptr;
+	// Decoding never makes a field longer
+	const char delims[2] = { delim, 0 };
+	size_t n = strcspn(ptr, delims);
+	string v = temp_alloc(sizeof(v->len) + n + 1);
+	if (!v)
+		return NULL;
+
+	const char *end = ptr + n;
+	for (v->len = 0; ptr < end; v->len++) {
+		int hi, lo;
+		if (*ptr == '+') {
+			v->buf[v->len] = ' ';
+			ptr++;
+		} else if (*ptr == '%' && end - ptr >= 3 &&
+		           (hi = hex_value(ptr[1])) >= 0 && (lo = hex_value(ptr[2])) >= 0) {
+			v->buf[v->len] = hi << 4 | lo;
+			ptr += 3;
+		} else {
+			// A '%' that isn't followed by two hex digits is kept as is
+			v->buf[v->len] = *ptr++;
+		}
+	}
+	v->buf[v->len] = 0;
+
+	// Don't move past the end of the string
+	*pptr = *end != 0 ? end + 1 : end;
+	return v;
+}
+
+
+cinja_dict parse_query(const char *q)
+{
+	const char *ptr = q;
+	cinja_dict d = cinja_temp_dict_create();
+	while (*ptr != 0) {
+		string key = copy_query_field(&ptr, '=');
+		string val = copy_query_field(&ptr, '&');
+		cinja_temp_dict_set(d, key, val);
+	}
+	return d;
+}
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include "../include/trace.h"
+
+#ifdef SOUP_TRACE
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+struct event {
+	const char *name;
+	uint64_t    start;
+	uint64_t    end;
+};
+
+/*
+ * Only the owning thread writes to a ring. Rings are never freed, as the
+ * threads that record spans live as long as the process.
+ */
+struct ring {
+	struct ring     *next;
+	pid_t            tid;
+	_Atomic uint64_t head;
+	struct event     events[TRACE_RING_SIZE];
+};
+
+static _Atomic(struct ring *) rings;
+static __thread struct ring  *local;
+
+
+/*
+ * Recording
+ */
+uint64_t trace_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static struct ring *ring_create()
+{
+	struct ring *r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+	r->tid  = syscall(SYS_gettid);
+	r->next = atomic_load(&rings);
+	while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+		;
+	return r;
+}
+
+
+void trace_span(const char *name, uint64_t start)
+{
+	struct ring *r = local;
+	if (r == NULL && (r = local = ring_create()) == NULL)
+		return;
+	uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	struct event *e = &r->events[h % TRACE_RING_SIZE];
+	e->name  = name;
+	e->start = start;
+	e->end   = trace_now();
+	atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+
+/*
+ * Dumping
+ */
+
+/*
+ * Writes the spans of a ring. The ring is written to while it is read, so
+ * events that may have been overwritten in the meantime are skipped.
+ */
+static size_t dump_ring(FILE *f, struct ring *r, pid_t pid, size_t written)
+{
+	static struct event copy[TRACE_RING_SIZE];
+	uint64_t head  = atomic_load_explicit(&r->head, memory_order_acquire);
+	uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	for (uint64_t i = first; i < head; i++)
+		copy[i % TRACE_RING_SIZE] = r->events[i % TRACE_RING_SIZE];
+	// Slots that were or are being written since belong to newer events
+	uint64_t now = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (now + 1 > first + TRACE_RING_SIZE)
+		first = now + 1 - TRACE_RING_SIZE;
+
+	for (uint64_t i = first; i < head; i++) {
+		struct event *e = &copy[i % TRACE_RING_SIZE];
+		fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"soup\",\"ph\":\"X\",\"ts\":%.3f,"
+		        "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}", written++ > 0 ? "," : "", e->name,
+		        e->start / 1e3, (e->end - e->start) / 1e3, pid, r->tid);
+	}
+	return written;
+}
+
+
+static void dump()
+{
+	const char *dir = getenv("TMPDIR");
+	char path[256], tmp[264];
+	pid_t pid = getpid();
+	snprintf(path, sizeof(path), "%s/soup-trace-%d.json", dir != NULL ? dir : "/tmp", pid);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		perror("Failed to dump trace");
+		return;
+	}
+	size_t n = 0;
+	fputs("{\"traceEvents\":[", f);
+	for (struct ring *r = atomic_load(&rings); r != NULL; r = r->next)
+		n = dump_ring(f, r, pid, n);
+	fputs("\n]}\n", f);
+	if (fclose(f) != 0 || rename(tmp, path) < 0) {
+		perror("Failed to dump trace");
+		unlink(tmp);
+		return;
+	}
+	fprintf(stderr, "Wrote %lu spans to %s\n", n, path);
+}
+
+
+static void *dumper(void *arg)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while (1) {
+		int sig;
+		if (sigwait(&set, &sig) == 0)
+			dump();
+	}
+	return NULL;
+}
+
+
+int trace_start_dumper()
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+		return -1;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, dumper, NULL) != 0)
+		return -1;
+	pthread_detach(thread);
+	return 0;
+}
+#endif